@@ -5,8 +5,11 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 
+#include <boost/asio/detached.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/use_future.hpp>
 #include <boost/beast/core/flat_buffer.hpp>
 #include <boost/beast/http/empty_body.hpp>
 #include <boost/beast/http/message.hpp>
@@ -14,8 +17,8 @@
 #include <boost/beast/http/status.hpp>
 #include <boost/beast/http/string_body.hpp>
 #include <boost/beast/http/write.hpp>
-#include <boost/mysql/any_connection.hpp>
-#include <boost/mysql/connect_params.hpp>
+#include <boost/mysql/connection_pool.hpp>
+#include <boost/mysql/pool_params.hpp>
 #include <boost/mysql/results.hpp>
 #include <boost/mysql/with_params.hpp>
 
@@ -47,9 +50,48 @@ std::optional<std::uint64_t> try_parse_id(std::string_view request_target)
 
 std::uint64_t parse_id(std::string_view request_target) { return try_parse_id(request_target).value(); }
 
+// Boost.MySQL's connection_pool only offers async functions.
+// This class wraps it to offer a blocking get_connection().
+// The pool runs in a background thread, while the connections it hands out
+// are used with sync functions from the thread that requested them.
+class sync_pool
+{
+    // The thread where the pool runs
+    asio::thread_pool thread_{1};
+
+    // The actual pool
+    mysql::connection_pool pool_;
+
+    // The pool is accessed from several threads, so it needs to be thread-safe
+    static mysql::pool_params make_thread_safe(mysql::pool_params params)
+    {
+        params.thread_safe = true;
+        return params;
+    }
+
+public:
+    sync_pool(mysql::pool_params params) : pool_(thread_, make_thread_safe(std::move(params)))
+    {
+        pool_.async_run(asio::detached);
+    }
+
+    sync_pool(const sync_pool&) = delete;
+    sync_pool& operator=(const sync_pool&) = delete;
+
+    ~sync_pool()
+    {
+        pool_.cancel();
+        thread_.join();
+    }
+
+    // Retrieves a connection from the pool, blocking until one is available.
+    // The connection is returned to the pool when the pooled_connection is destroyed.
+    mysql::pooled_connection get_connection() { return pool_.async_get_connection(asio::use_future).get(); }
+};
+
 // Runs an individual HTTP session: reads a request,
 // processes it, and writes the response.
-void run_session(asio::ip::tcp::socket& sock)
+void run_session(sync_pool& pool, asio::ip::tcp::socket& sock)
 {
     // Read a request
     beast::flat_buffer buff;
@@ -57,12 +99,13 @@ void run_session(asio::ip::tcp::socket& sock)
     http::read(sock, buff, req);
     std::uint64_t id = parse_id(req.target());
 
-    // Query the database
-    mysql::any_connection conn(sock.get_executor());
-    conn.connect({.username = "me", .password = "secret", .database = "correlations"});
-
+    // Query the database. The connection is returned to the pool at the end of the block,
+    // rather than held while the response is written to a client that may be slow to read it
     mysql::results r;
-    conn.execute(mysql::with_params("SELECT subject FROM correlations WHERE id = {}", id), r);
+    {
+        mysql::pooled_connection conn = pool.get_connection();
+        conn->execute(mysql::with_params("SELECT subject FROM correlations WHERE id = {}", id), r);
+    }
 
     // Compose the response
     http::response<http::string_body> res;
@@ -87,6 +130,11 @@ int main()
     // including a scheduler, timer queues, file descriptors...
     asio::io_context ctx;
 
+    // A pool of connections to the database. Connections are kept open
+    // and reused between requests, so we don't pay for a TCP handshake,
+    // TLS negotiation and authentication for each request.
+    sync_pool pool({.username = "me", .password = "secret", .database = "correlations"});
+
     // Set up an object listening for TCP connections in port 8080
     asio::ip::tcp::acceptor acceptor(ctx);
     acceptor.open(asio::ip::tcp::v4());
@@ -101,6 +149,6 @@ int main()
         asio::ip::tcp::socket sock = acceptor.accept();
 
         // Launch a session.
-        run_session(sock);
+        run_session(pool, sock);
     }
 }
@@ -7,6 +7,7 @@
 
 #include <boost/asio/awaitable.hpp>
 #include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/this_coro.hpp>
@@ -17,8 +18,8 @@
 #include <boost/beast/http/status.hpp>
 #include <boost/beast/http/string_body.hpp>
 #include <boost/beast/http/write.hpp>
-#include <boost/mysql/any_connection.hpp>
-#include <boost/mysql/connect_params.hpp>
+#include <boost/mysql/connection_pool.hpp>
+#include <boost/mysql/pool_params.hpp>
 #include <boost/mysql/results.hpp>
 #include <boost/mysql/with_params.hpp>
 
@@ -53,7 +54,10 @@ std::uint64_t parse_id(std::string_view request_target) { return try_parse_id(re
 
 // Runs an individual HTTP session: reads a request,
 // processes it, and writes the response.
-asio::awaitable<void> run_session(asio::ip::tcp::socket& sock)
+// The connection is closed after a single response. Keeping it alive for more requests
+// requires closing it if the client stays idle for too long, which needs timeouts
+// (see 4_timeouts.cpp).
+asio::awaitable<void> run_session(mysql::connection_pool& pool, asio::ip::tcp::socket& sock)
 {
     // Read a request
     beast::flat_buffer buff;
@@ -61,12 +65,16 @@ asio::awaitable<void> run_session(asio::ip::tcp::socket& sock)
     co_await http::async_read(sock, buff, req);
     std::uint64_t id = parse_id(req.target());
 
-    // Query the database
-    mysql::any_connection conn(sock.get_executor());
-    co_await conn.async_connect({.username = "me", .password = "secret", .database = "correlations"});
-
+    // Query the database. The connection is returned to the pool at the end of the block,
+    // rather than held while the response is written to a client that may be slow to read it
     mysql::results r;
-    co_await conn.async_execute(mysql::with_params("SELECT subject FROM correlations WHERE id = {}", id), r);
+    {
+        mysql::pooled_connection conn = co_await pool.async_get_connection();
+        co_await conn->async_execute(
+            mysql::with_params("SELECT subject FROM correlations WHERE id = {}", id),
+            r
+        );
+    }
 
     // Compose the response
     http::response<http::string_body> res;
@@ -82,7 +90,7 @@ asio::awaitable<void> run_session(asio::ip::tcp::socket& sock)
     co_await http::async_write(sock, res);
 }
 
-asio::awaitable<void> run_server()
+asio::awaitable<void> run_server(mysql::connection_pool& pool)
 {
     // Set up an object listening for TCP connections in port 8080
     asio::ip::tcp::acceptor acceptor(co_await asio::this_coro::executor);
@@ -98,7 +106,7 @@ asio::awaitable<void> run_server()
         asio::ip::tcp::socket sock = co_await acceptor.async_accept();
 
         // Launch a session.
-        co_await run_session(sock);
+        co_await run_session(pool, sock);
     }
 }
 
@@ -108,12 +116,18 @@ int main()
 {
     asio::io_context ctx;
 
+    // A pool of connections to the database. Connections are kept open
+    // and reused between requests, so we don't pay for a TCP handshake,
+    // TLS negotiation and authentication for each request.
+    mysql::connection_pool pool(ctx, {.username = "me", .password = "secret", .database = "correlations"});
+    pool.async_run(asio::detached);
+
     asio::co_spawn(
         // Spawn a coroutine using this execution context
         ctx,
 
         // The actual code to run, as a callable
-        &run_server,
+        [&pool] { return run_server(pool); },
 
         // When the coroutine finishes, run this callback
         [](std::exception_ptr exc) {
@@ -5,25 +5,32 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 
+#include <boost/asio/as_tuple.hpp>
 #include <boost/asio/awaitable.hpp>
 #include <boost/asio/cancel_after.hpp>
 #include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/this_coro.hpp>
+#include <boost/asio/use_awaitable.hpp>
 #include <boost/beast/core/flat_buffer.hpp>
 #include <boost/beast/http/empty_body.hpp>
+#include <boost/beast/http/error.hpp>
 #include <boost/beast/http/message.hpp>
 #include <boost/beast/http/read.hpp>
 #include <boost/beast/http/status.hpp>
 #include <boost/beast/http/string_body.hpp>
 #include <boost/beast/http/write.hpp>
-#include <boost/mysql/any_connection.hpp>
-#include <boost/mysql/connect_params.hpp>
+#include <boost/mysql/connection_pool.hpp>
+#include <boost/mysql/pool_params.hpp>
 #include <boost/mysql/results.hpp>
 #include <boost/mysql/with_params.hpp>
+#include <boost/system/system_error.hpp>
 
 #include <charconv>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <exception>
 #include <iostream>
@@ -65,47 +72,80 @@ void log_error(std::exception_ptr exc)
     }
 }
 
-// Runs an individual HTTP session: reads a request,
-// processes it, and writes the response.
-asio::awaitable<void> run_session(asio::ip::tcp::socket sock)
+// How long a connection may stay idle between requests before we close it
+constexpr std::chrono::seconds idle_timeout{10};
+
+// Maximum number of requests to serve on a single connection before closing it
+constexpr std::size_t max_requests_per_connection = 100;
+
+// Runs an individual HTTP session: reads requests, processes them,
+// and writes the responses back, until the client is done
+// or we reach the maximum number of requests per connection.
+asio::awaitable<void> run_session(mysql::connection_pool& pool, asio::ip::tcp::socket sock)
 {
     using namespace std::chrono_literals;
 
-    // Read a request
+    // The buffer is reused between requests
     beast::flat_buffer buff;
-    http::request<http::empty_body> req;
-    co_await http::async_read(sock, buff, req, asio::cancel_after(30s));
-    std::uint64_t id = parse_id(req.target());
-
-    // Query the database
-    mysql::any_connection conn(sock.get_executor());
-    co_await conn.async_connect(
-        {.username = "me", .password = "secret", .database = "correlations"},
-        asio::cancel_after(30s)
-    );
-
-    mysql::results r;
-    co_await conn.async_execute(
-        mysql::with_params("SELECT subject FROM correlations WHERE id = {}", id),
-        r,
-        asio::cancel_after(30s)
-    );
-
-    // Compose the response
-    http::response<http::string_body> res;
-    if (r.rows().empty())
-        res.result(http::status::not_found);
-    else
-        res.body() = r.rows().at(0).at(0).as_string();
-
-    // Write the response back
-    res.version(req.version());
-    res.keep_alive(false);
-    res.prepare_payload();
-    co_await http::async_write(sock, res, asio::cancel_after(30s));
+
+    for (std::size_t num_requests = 1;; ++num_requests)
+    {
+        // Wait until the client starts sending the next request,
+        // closing the connection if it stays idle for too long
+        if (buff.size() == 0)
+        {
+            auto [ec] = co_await sock.async_wait(
+                asio::socket_base::wait_read,
+                asio::cancel_after(idle_timeout, asio::as_tuple(asio::use_awaitable))
+            );
+            if (ec)
+                co_return;
+        }
+
+        // Read a request. The client closing the connection is not an error
+        http::request<http::empty_body> req;
+        auto [ec, bytes_read] = co_await http::async_read(
+            sock,
+            buff,
+            req,
+            asio::cancel_after(30s, asio::as_tuple(asio::use_awaitable))
+        );
+        if (ec == http::error::end_of_stream)
+            co_return;
+        else if (ec)
+            throw boost::system::system_error(ec);
+        std::uint64_t id = parse_id(req.target());
+
+        // Query the database. The connection is returned to the pool at the end of the block,
+        // rather than held while the response is written to a client that may be slow to read it
+        mysql::results r;
+        {
+            mysql::pooled_connection conn = co_await pool.async_get_connection(asio::cancel_after(30s));
+            co_await conn->async_execute(
+                mysql::with_params("SELECT subject FROM correlations WHERE id = {}", id),
+                r,
+                asio::cancel_after(30s)
+            );
+        }
+
+        // Compose the response
+        http::response<http::string_body> res;
+        if (r.rows().empty())
+            res.result(http::status::not_found);
+        else
+            res.body() = r.rows().at(0).at(0).as_string();
+
+        // Write the response back, keeping the connection alive if the client asked for it
+        res.version(req.version());
+        res.keep_alive(req.keep_alive() && num_requests < max_requests_per_connection);
+        res.prepare_payload();
+        co_await http::async_write(sock, res, asio::cancel_after(30s));
+        if (!res.keep_alive())
+            co_return;
+    }
 }
 
-asio::awaitable<void> run_server()
+asio::awaitable<void> run_server(mysql::connection_pool& pool)
 {
     // Set up an object listening for TCP connections in port 8080
     asio::ip::tcp::acceptor acceptor(co_await asio::this_coro::executor);
@@ -123,7 +163,7 @@ asio::awaitable<void> run_server()
         // Launch a session, but don't wait for it
         asio::co_spawn(
             co_await asio::this_coro::executor,
-            run_session(std::move(sock)),
+            run_session(pool, std::move(sock)),
             [](std::exception_ptr exc) {
                 if (exc)
                     log_error(exc);
@@ -141,7 +181,13 @@ int main()
     // including a scheduler, timer queues, file descriptors...
     asio::io_context ctx;
 
-    asio::co_spawn(ctx, &run_server, [](std::exception_ptr exc) {
+    // A pool of connections to the database. Connections are kept open
+    // and reused between requests, so we don't pay for a TCP handshake,
+    // TLS negotiation and authentication for each request.
+    mysql::connection_pool pool(ctx, {.username = "me", .password = "secret", .database = "correlations"});
+    pool.async_run(asio::detached);
+
+    asio::co_spawn(ctx, [&pool] { return run_server(pool); }, [](std::exception_ptr exc) {
         if (exc)
             std::rethrow_exception(exc);
     });
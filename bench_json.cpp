@@ -0,0 +1,148 @@
+//
+// Copyright (c) 2019-2025 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+/**
+ * Microbenchmark for the JSON string escaping used by the cancellations server
+ * (json_escape.hpp), compared to Boost.JSON's serializer.
+ * Strings are like the subjects in db_setup.sql: up to 200 characters,
+ * most of which don't need escaping. A second set has a character to escape
+ * every few characters, which is the worst case for our escaper.
+ *
+ * Build with -DCMAKE_CXX_FLAGS=-march=native to enable the AVX2 code path.
+ * Usage: bench_json [<iterations>]
+ */
+
+#include <boost/json/parse.hpp>
+#include <boost/json/serialize.hpp>
+#include <boost/json/serializer.hpp>
+#include <boost/json/src.hpp>
+#include <boost/json/string_view.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "json_escape.hpp"
+
+namespace json = boost::json;
+
+namespace {
+
+// Generates strings of random lengths, up to 200 characters, like the table's subjects.
+// special is the probability of each character being one that requires escaping
+std::vector<std::string> make_subjects(std::size_t count, double special)
+{
+    constexpr std::string_view plain = "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.,'-";
+    constexpr std::string_view escaped = "\"\\\n\t";
+
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<std::size_t> length(20, 200);
+    std::uniform_int_distribution<std::size_t> plain_char(0, plain.size() - 1);
+    std::uniform_int_distribution<std::size_t> escaped_char(0, escaped.size() - 1);
+    std::bernoulli_distribution is_special(special);
+
+    std::vector<std::string> res(count);
+    for (auto& s : res)
+    {
+        s.resize(length(gen));
+        for (char& c : s)
+            c = is_special(gen) ? escaped[escaped_char(gen)] : plain[plain_char(gen)];
+    }
+    return res;
+}
+
+// Checks that our escaper produces valid JSON strings with the original contents
+void check_roundtrip(const std::vector<std::string>& subjects)
+{
+    std::string out;
+    for (const auto& s : subjects)
+    {
+        out.clear();
+        append_json_string(out, s);
+        if (json::parse(out).as_string() != json::string_view(s))
+        {
+            std::cerr << "append_json_string produced an invalid string: " << out << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Runs fn(out, subject) for every subject, iterations times, and prints the time per string.
+// The output buffer is cleared every 100 strings, like a response body
+template <class Fn>
+void run(std::string_view name, const std::vector<std::string>& subjects, std::size_t iterations, Fn fn)
+{
+    std::string out;
+    std::size_t total_bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t it = 0; it < iterations; ++it)
+    {
+        for (std::size_t i = 0; i < subjects.size(); ++i)
+        {
+            if (i % 100 == 0)
+            {
+                total_bytes += out.size();
+                out.clear();
+            }
+            fn(out, subjects[i]);
+        }
+    }
+    total_bytes += out.size();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    double num_strings = static_cast<double>(subjects.size() * iterations);
+    std::cout << "  " << name << ": " << elapsed.count() * 1e9 / num_strings << " ns/string, "
+              << static_cast<double>(total_bytes) / elapsed.count() / 1e6 << " MB/s of output" << std::endl;
+}
+
+void bench(std::string_view name, const std::vector<std::string>& subjects, std::size_t iterations)
+{
+    check_roundtrip(subjects);
+    std::cout << name << std::endl;
+
+    run("append_json_string", subjects, iterations, [](std::string& out, const std::string& s) {
+        append_json_string(out, s);
+    });
+
+    // The serializer is reused, and writes to a buffer that fits any escaped subject
+    json::serializer sr;
+    char buff[2048];
+    run("json::serializer", subjects, iterations, [&](std::string& out, const std::string& s) {
+        json::string_view sv(s);
+        sr.reset(&sv);
+        while (!sr.done())
+        {
+            auto part = sr.read(buff, sizeof(buff));
+            out.append(part.data(), part.size());
+        }
+    });
+
+    // The simplest way to use Boost.JSON, which allocates a string each time
+    run("json::serialize", subjects, iterations, [](std::string& out, const std::string& s) {
+        out += json::serialize(json::string_view(s));
+    });
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    std::size_t iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100;
+    if (iterations == 0)
+    {
+        std::cerr << "Usage: " << argv[0] << " [<iterations>]\n";
+        return EXIT_FAILURE;
+    }
+
+    bench("Subjects (0.1% of characters escaped)", make_subjects(10000, 0.001), iterations);
+    bench("Worst case (20% of characters escaped)", make_subjects(10000, 0.2), iterations);
+}
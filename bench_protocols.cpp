@@ -0,0 +1,328 @@
+//
+// Copyright (c) 2019-2025 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+/**
+ * Load generator comparing the cancellations server's binary protocol with HTTP.
+ * Start the server with --binary-port, then run:
+ *    bench_protocols <server-ip> <http-port> <binary-port> <max-id> [--connections=<num>]
+ *                    [--depth=<num-requests>] [--seconds=<seconds>] [--threads=<num-threads>]
+ *
+ * Each connection sends a batch of depth requests for random IDs between 1 and max-id,
+ * reads their responses, and repeats (closed loop). HTTP requests are pipelined.
+ * Both protocols get the same load, and an unmeasured HTTP run warms the server's cache first.
+ * Reports the throughput and the latency of individual requests, measured from the moment
+ * their batch was written.
+ */
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/address.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/beast/http/read.hpp>
+#include <boost/beast/http/status.hpp>
+#include <boost/beast/http/string_body.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "binary_protocol.hpp"
+#include "command_line.hpp"
+
+namespace asio = boost::asio;
+namespace beast = boost::beast;
+namespace http = beast::http;
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+struct bench_config
+{
+    asio::ip::address address;
+    unsigned short http_port{};
+    unsigned short binary_port{};
+    std::int64_t max_id{};
+    std::size_t num_connections{64};
+    std::size_t depth{16};
+    std::chrono::seconds duration{10};
+    std::size_t num_threads{1};
+};
+
+// What a thread measured. Merged once all threads finish
+struct bench_stats
+{
+    std::vector<double> latencies_us;
+    std::size_t errors{};
+    std::size_t failed_connections{};
+
+    void record(clock_type::time_point sent, bool ok)
+    {
+        if (!ok)
+        {
+            ++errors;
+            return;
+        }
+        std::chrono::duration<double, std::micro> latency = clock_type::now() - sent;
+        latencies_us.push_back(latency.count());
+    }
+};
+
+// Runs an HTTP connection until the deadline. The server closes connections after a number
+// of requests (--max-requests). Requests pipelined after that are lost, and we reconnect
+asio::awaitable<void> run_http_connection(
+    const bench_config& cfg,
+    clock_type::time_point end,
+    bench_stats& stats,
+    std::uint64_t seed
+)
+{
+    auto ex = co_await asio::this_coro::executor;
+    asio::ip::tcp::endpoint endpoint(cfg.address, cfg.http_port);
+    std::mt19937_64 gen(seed);
+    std::uniform_int_distribution<std::int64_t> ids(1, cfg.max_id);
+
+    asio::ip::tcp::socket sock(ex);
+    beast::flat_buffer buff;
+    std::string requests;
+    while (clock_type::now() < end)
+    {
+        if (!sock.is_open())
+        {
+            co_await sock.async_connect(endpoint, asio::use_awaitable);
+            sock.set_option(asio::ip::tcp::no_delay(true));
+            buff.clear();
+        }
+
+        requests.clear();
+        for (std::size_t i = 0; i < cfg.depth; ++i)
+        {
+            requests += "GET /";
+            requests += std::to_string(ids(gen));
+            requests += " HTTP/1.1\r\nHost: bench\r\n\r\n";
+        }
+        auto sent = clock_type::now();
+        co_await asio::async_write(sock, asio::buffer(requests), asio::use_awaitable);
+
+        bool keep_alive = true;
+        for (std::size_t i = 0; i < cfg.depth && keep_alive; ++i)
+        {
+            http::response<http::string_body> res;
+            co_await http::async_read(sock, buff, res, asio::use_awaitable);
+            stats.record(sent, res.result() == http::status::ok || res.result() == http::status::not_found);
+            keep_alive = res.keep_alive();
+        }
+        if (!keep_alive)
+            sock.close();
+    }
+}
+
+// Runs a binary protocol connection until the deadline
+asio::awaitable<void> run_binary_connection(
+    const bench_config& cfg,
+    clock_type::time_point end,
+    bench_stats& stats,
+    std::uint64_t seed
+)
+{
+    constexpr std::size_t request_size = binary_frame_prefix_size + binary_request_size;
+
+    auto ex = co_await asio::this_coro::executor;
+    asio::ip::tcp::socket sock(ex);
+    co_await sock.async_connect({cfg.address, cfg.binary_port}, asio::use_awaitable);
+    sock.set_option(asio::ip::tcp::no_delay(true));
+
+    std::mt19937_64 gen(seed);
+    std::uniform_int_distribution<std::int64_t> ids(1, cfg.max_id);
+    std::vector<unsigned char> requests(request_size * cfg.depth);
+    std::vector<unsigned char> body;
+    std::array<unsigned char, binary_frame_prefix_size> frame_size{};
+
+    while (clock_type::now() < end)
+    {
+        // Frame size, request ID and correlation ID
+        for (std::size_t i = 0; i < cfg.depth; ++i)
+        {
+            unsigned char* req = requests.data() + i * request_size;
+            store_big_endian(req, binary_request_size, 4);
+            store_big_endian(req + 4, i, 4);
+            store_big_endian(req + 8, static_cast<std::uint64_t>(ids(gen)), 8);
+        }
+        auto sent = clock_type::now();
+        co_await asio::async_write(sock, asio::buffer(requests), asio::use_awaitable);
+
+        // Responses may arrive in any order, but we only need to count them
+        for (std::size_t i = 0; i < cfg.depth; ++i)
+        {
+            co_await asio::async_read(sock, asio::buffer(frame_size), asio::use_awaitable);
+            body.resize(load_big_endian(frame_size.data(), 4));
+            co_await asio::async_read(sock, asio::buffer(body), asio::use_awaitable);
+
+            // Request ID (4 bytes) and status (1 byte)
+            stats.record(
+                sent,
+                body.size() >= binary_response_header_size &&
+                    (body[4] == static_cast<unsigned char>(binary_status::ok) ||
+                     body[4] == static_cast<unsigned char>(binary_status::not_found))
+            );
+        }
+    }
+}
+
+// Runs the given kind of connection on every thread, and returns the merged stats.
+// Each thread has its own io_context and stats, so threads don't share anything
+template <class ConnectionFn>
+bench_stats run_phase(const bench_config& cfg, ConnectionFn connection_fn)
+{
+    std::vector<bench_stats> thread_stats(cfg.num_threads);
+    std::vector<std::thread> threads;
+    auto end = clock_type::now() + cfg.duration;
+
+    for (std::size_t t = 0; t < cfg.num_threads; ++t)
+    {
+        threads.emplace_back([&cfg, &connection_fn, &stats = thread_stats[t], end, t] {
+            asio::io_context ctx(1);
+            for (std::size_t i = t; i < cfg.num_connections; i += cfg.num_threads)
+            {
+                asio::co_spawn(ctx, connection_fn(cfg, end, stats, i), [&stats](std::exception_ptr exc) {
+                    if (!exc)
+                        return;
+                    ++stats.failed_connections;
+                    try
+                    {
+                        std::rethrow_exception(exc);
+                    }
+                    catch (const std::exception& err)
+                    {
+                        std::cerr << "Connection failed: " << err.what() << std::endl;
+                    }
+                });
+            }
+            ctx.run();
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+
+    bench_stats res;
+    for (auto& s : thread_stats)
+    {
+        res.latencies_us.insert(res.latencies_us.end(), s.latencies_us.begin(), s.latencies_us.end());
+        res.errors += s.errors;
+        res.failed_connections += s.failed_connections;
+    }
+    return res;
+}
+
+void print_stats(std::string_view name, bench_stats& stats, std::chrono::seconds duration)
+{
+    auto& lat = stats.latencies_us;
+    std::sort(lat.begin(), lat.end());
+    auto percentile = [&lat](double p) {
+        return lat.empty() ? 0.0 : lat[static_cast<std::size_t>(p * static_cast<double>(lat.size() - 1))];
+    };
+
+    std::cout << name << ": " << static_cast<double>(lat.size()) / static_cast<double>(duration.count())
+              << " requests/s, latency p50 " << percentile(0.5) << " us, p99 " << percentile(0.99)
+              << " us, max " << percentile(1.0) << " us, " << stats.errors << " errors, "
+              << stats.failed_connections << " failed connections" << std::endl;
+}
+
+// Parses the command line. Returns an empty optional if it's not valid.
+std::optional<bench_config> parse_config(int argc, char** argv)
+{
+    if (argc < 5)
+        return {};
+
+    bench_config res;
+    boost::system::error_code ec;
+    res.address = asio::ip::make_address(argv[1], ec);
+    if (ec || !parse_flag_value(argv[2], res.http_port) || !parse_flag_value(argv[3], res.binary_port) ||
+        !parse_flag_value(argv[4], res.max_id) || res.max_id <= 0)
+        return {};
+
+    // Optional flags, with the form --name=value
+    for (int i = 5; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+        auto eq_pos = arg.find('=');
+        if (!arg.starts_with("--") || eq_pos == std::string_view::npos)
+            return {};
+        std::string_view name = arg.substr(2, eq_pos - 2);
+        std::string_view value = arg.substr(eq_pos + 1);
+
+        std::chrono::seconds::rep seconds{};
+        if (name == "connections")
+        {
+            if (!parse_flag_value(value, res.num_connections) || res.num_connections == 0)
+                return {};
+        }
+        else if (name == "depth")
+        {
+            if (!parse_flag_value(value, res.depth) || res.depth == 0)
+                return {};
+        }
+        else if (name == "seconds")
+        {
+            if (!parse_flag_value(value, seconds) || seconds <= 0)
+                return {};
+            res.duration = std::chrono::seconds(seconds);
+        }
+        else if (name == "threads")
+        {
+            if (!parse_flag_value(value, res.num_threads) || res.num_threads == 0)
+                return {};
+        }
+        else
+        {
+            return {};
+        }
+    }
+    return res;
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    std::optional<bench_config> cfg = parse_config(argc, argv);
+    if (!cfg)
+    {
+        std::cerr << "Usage: " << argv[0]
+                  << " <server-ip> <http-port> <binary-port> <max-id> [--connections=<num>] "
+                     "[--depth=<num-requests>] [--seconds=<seconds>] [--threads=<num-threads>]\n";
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "Warming up the cache..." << std::endl;
+    run_phase(*cfg, run_http_connection);
+
+    auto http_stats = run_phase(*cfg, run_http_connection);
+    print_stats("HTTP", http_stats, cfg->duration);
+    auto binary_stats = run_phase(*cfg, run_binary_connection);
+    print_stats("Binary", binary_stats, cfg->duration);
+}
@@ -0,0 +1,111 @@
+//
+// Copyright (c) 2019-2025 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+/**
+ * Microbenchmark for the timer wheel used by the cancellations server
+ * (timer_wheel.hpp), compared to asio::cancel_after.
+ * Many coroutines run operations with a timeout that never expires,
+ * like a server's requests do. The operation is a post, which completes right away,
+ * so the time is dominated by arming and disarming timeouts. Every coroutine
+ * has an operation in flight, so there are as many timeouts armed as coroutines.
+ *
+ * Usage: bench_timeouts [<num-coroutines> [<operations-per-coroutine>]]
+ */
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/cancel_after.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <string_view>
+
+#include "timer_wheel.hpp"
+
+namespace asio = boost::asio;
+
+namespace {
+
+enum class timeout_kind
+{
+    none,
+    cancel_after,
+    wheel,
+};
+
+// Runs a number of operations, each with the given kind of timeout
+asio::awaitable<void> run_operations(timeout_kind kind, timer_wheel& wheel, std::size_t num_operations)
+{
+    using namespace std::chrono_literals;
+
+    auto ex = co_await asio::this_coro::executor;
+    for (std::size_t i = 0; i < num_operations; ++i)
+    {
+        switch (kind)
+        {
+        case timeout_kind::none: co_await asio::post(ex, asio::use_awaitable); break;
+        case timeout_kind::cancel_after:
+            co_await asio::post(ex, asio::cancel_after(30s, asio::use_awaitable));
+            break;
+        case timeout_kind::wheel:
+            co_await asio::post(ex, wheel_cancel_after(wheel, 30s, asio::use_awaitable));
+            break;
+        }
+    }
+}
+
+// Runs the coroutines to completion, and returns the time per operation, in nanoseconds
+double run(timeout_kind kind, std::size_t num_coroutines, std::size_t num_operations)
+{
+    using namespace std::chrono_literals;
+
+    // The wheel must outlive the handlers destroyed by the io_context
+    timer_wheel wheel(10ms);
+    asio::io_context ctx(1);
+    wheel.start(ctx.get_executor());
+
+    for (std::size_t i = 0; i < num_coroutines; ++i)
+        asio::co_spawn(ctx, run_operations(kind, wheel, num_operations), asio::detached);
+
+    auto start = std::chrono::steady_clock::now();
+    ctx.run();
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+    wheel.stop();
+    return elapsed.count() / static_cast<double>(num_coroutines * num_operations);
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    std::size_t num_coroutines = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000;
+    std::size_t num_operations = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 100;
+    if (num_coroutines == 0 || num_operations == 0)
+    {
+        std::cerr << "Usage: " << argv[0] << " [<num-coroutines> [<operations-per-coroutine>]]\n";
+        return EXIT_FAILURE;
+    }
+
+    double baseline = run(timeout_kind::none, num_coroutines, num_operations);
+    double cancel_after = run(timeout_kind::cancel_after, num_coroutines, num_operations);
+    double wheel = run(timeout_kind::wheel, num_coroutines, num_operations);
+
+    std::cout << num_coroutines << " coroutines, " << num_operations << " operations each\n"
+              << "  no timeout:         " << baseline << " ns/operation\n"
+              << "  asio::cancel_after: " << cancel_after << " ns/operation (+" << cancel_after - baseline
+              << " ns)\n"
+              << "  wheel_cancel_after: " << wheel << " ns/operation (+" << wheel - baseline << " ns)"
+              << std::endl;
+}
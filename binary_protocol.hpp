@@ -0,0 +1,59 @@
+//
+// Copyright (c) 2019-2025 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef USINGSTDCPP_2025_BINARY_PROTOCOL_HPP
+#define USINGSTDCPP_2025_BINARY_PROTOCOL_HPP
+
+// The wire format of the cancellations server's binary lookup protocol.
+// It lives in its own header so bench_protocols speaks the same protocol as the server.
+
+#include <cstddef>
+#include <cstdint>
+
+// The binary lookup protocol, for clients that don't need HTTP.
+// Messages are sent as frames: the size of the rest of the frame, in bytes, followed by the message.
+// Integers are unsigned and big-endian, except IDs, which are signed.
+//    Request:  frame size (4 bytes), request ID (4 bytes), correlation ID (8 bytes)
+//    Response: frame size (4 bytes), request ID (4 bytes), status (1 byte), subject (the rest of the frame)
+// Request IDs are chosen by the client. Requests in a connection are handled concurrently,
+// and each response is sent as soon as it's ready, so responses may arrive in any order.
+// Clients match them to their requests using the request ID.
+enum class binary_status : std::uint8_t
+{
+    ok = 0,
+    not_found = 1,
+    error = 2,
+};
+
+// The size of the frame size that precedes every message
+constexpr std::size_t binary_frame_prefix_size = 4;
+
+// The size of a binary protocol request, excluding the frame size
+constexpr std::uint32_t binary_request_size = 12;
+
+// The size of a binary protocol response without its subject, excluding the frame size
+constexpr std::uint32_t binary_response_header_size = 5;
+
+// Reads and writes big-endian integers of the given size
+inline std::uint64_t load_big_endian(const unsigned char* from, std::size_t size)
+{
+    std::uint64_t res = 0;
+    for (std::size_t i = 0; i < size; ++i)
+        res = (res << 8) | from[i];
+    return res;
+}
+
+inline void store_big_endian(unsigned char* to, std::uint64_t value, std::size_t size)
+{
+    for (std::size_t i = size; i > 0; --i)
+    {
+        to[i - 1] = static_cast<unsigned char>(value & 0xff);
+        value >>= 8;
+    }
+}
+
+#endif
@@ -12,9 +12,10 @@
  *
  * This program implements a simplistic HTTP server that accesses
  * a SQL database when handling client requests.
- * Recognizes requests with the form GET /employee/{id},
- * where id is an integral number identifying an employee.
- * It returns a plaintext body with the employee's last name.
+ * Recognizes requests with the form GET /{id},
+ * where id is an integral number identifying a spurious correlation.
+ * It returns a plaintext body with the correlation's subject.
+ * Use db_setup.sql to create the database.
  *
  * The main point of this server is learning about
  * per-operation cancellation in Asio.
@@ -22,34 +23,98 @@
  * the example more realistic.
  */
 
+#include <boost/asio/as_tuple.hpp>
 #include <boost/asio/awaitable.hpp>
+#include <boost/asio/bind_cancellation_slot.hpp>
 #include <boost/asio/cancel_after.hpp>
+#include <boost/asio/cancellation_signal.hpp>
+#include <boost/asio/cancellation_type.hpp>
 #include <boost/asio/co_spawn.hpp>
+#include <boost/asio/deferred.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/experimental/parallel_group.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/asio/signal_set.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/this_coro.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/core/buffers_range.hpp>
 #include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/http/chunk_encode.hpp>
 #include <boost/beast/http/empty_body.hpp>
+#include <boost/beast/http/error.hpp>
+#include <boost/beast/http/field.hpp>
 #include <boost/beast/http/message.hpp>
+#include <boost/beast/http/parser.hpp>
 #include <boost/beast/http/read.hpp>
+#include <boost/beast/http/serializer.hpp>
 #include <boost/beast/http/status.hpp>
 #include <boost/beast/http/string_body.hpp>
 #include <boost/beast/http/verb.hpp>
 #include <boost/beast/http/write.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/mysql/any_connection.hpp>
+#include <boost/mysql/connect_params.hpp>
 #include <boost/mysql/connection_pool.hpp>
+#include <boost/mysql/datetime.hpp>
+#include <boost/mysql/execution_state.hpp>
 #include <boost/mysql/results.hpp>
+#include <boost/mysql/rows_view.hpp>
+#include <boost/mysql/statement.hpp>
 #include <boost/mysql/with_params.hpp>
 #include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <charconv>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <deque>
 #include <exception>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <span>
+#include <stdexcept>
 #include <string>
 #include <string_view>
 #include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "binary_protocol.hpp"
+#include "command_line.hpp"
+#include "json_escape.hpp"
+#include "timer_wheel.hpp"
 
 namespace asio = boost::asio;
 namespace beast = boost::beast;
@@ -59,173 +124,4158 @@ using boost::system::error_code;
 
 namespace {
 
-// Helper function to log unhandled exceptions
-// when handling requests
-void log_exception(std::exception_ptr exc)
+#ifdef SO_REUSEPORT
+// Asio doesn't provide a portable SO_REUSEPORT option, so we define our own,
+// following Asio's SettableSocketOption requirements.
+// SO_REUSEPORT allows several sockets to bind to the same address and port.
+class reuse_port_option
+{
+    int value_;
+
+public:
+    explicit reuse_port_option(bool value) : value_(value ? 1 : 0) {}
+
+    template <class Protocol>
+    int level(const Protocol&) const
+    {
+        return SOL_SOCKET;
+    }
+
+    template <class Protocol>
+    int name(const Protocol&) const
+    {
+        return SO_REUSEPORT;
+    }
+
+    template <class Protocol>
+    const void* data(const Protocol&) const
+    {
+        return &value_;
+    }
+
+    template <class Protocol>
+    std::size_t size(const Protocol&) const
+    {
+        return sizeof(value_);
+    }
+};
+#endif
+
+// The CPUs this process may run on, as restricted by its affinity mask
+// (e.g. by taskset or a cpuset cgroup). Empty if unknown
+std::vector<int> usable_cpus()
+{
+    std::vector<int> res;
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &cpus))
+                res.push_back(cpu);
+        }
+    }
+#endif
+    return res;
+}
+
+// Server configuration, parsed from the command line
+struct server_config
+{
+    // Database credentials and location
+    std::string db_username;
+    std::string db_password;
+    std::string db_hostname;
+
+    // The port where the HTTP server listens
+    unsigned short http_port{};
+
+    // The port where the binary protocol server listens. 0 disables it
+    unsigned short binary_port{};
+
+    // Number of threads to run. Each thread runs its own io_context,
+    // connection pool and acceptor (thread-per-core mode).
+    // 1 yields a classic, single-threaded server.
+    std::size_t num_threads{1};
+
+    // How long a keep-alive connection may stay idle between requests
+    // before we close it
+    std::chrono::seconds idle_timeout{30};
+
+    // The time budget for a request, from the moment it starts arriving until
+    // its response is written. Every stage (reading, waiting for a connection,
+    // querying and writing) draws from it. Streamed responses (ranges and exports) use it
+    // until their headers are written, and then give each batch and chunk a budget this long
+    std::chrono::seconds request_timeout{30};
+
+    // Maximum number of requests to serve on a single connection
+    // before closing it. 0 means no limit.
+    std::size_t max_requests_per_connection{1000};
+
+    // Maximum number of pipelined requests to handle concurrently.
+    // Also limits the requests in flight in binary protocol connections
+    std::size_t max_pipeline_depth{64};
+
+    // Lookups for different IDs are grouped into a single query.
+    // A batch is dispatched when it contains this many IDs...
+    std::size_t max_batch_size{64};
+
+    // ...or when this time has elapsed since the first ID joined it
+    std::chrono::microseconds batch_window{200};
+
+    // Memory that the response cache may use, in bytes
+    std::size_t cache_memory_budget{64 * 1024 * 1024};
+
+    // How long cached responses are considered fresh
+    std::chrono::seconds cache_ttl{60};
+
+    // How long cached responses may be served after they stop being fresh,
+    // while they're refreshed in the background. 0 disables background refreshes
+    std::chrono::seconds cache_max_staleness{60};
+
+    // The maximum number of IDs in a single GET /correlations?ids=... request
+    std::size_t max_ids_per_lookup{1000};
+
+    // The maximum number of IDs prefetched at once when a connection
+    // requests IDs sequentially. 0 disables prefetching
+    std::int64_t max_readahead{256};
+
+    // The number of most requested IDs tracked by each worker.
+    // Their cache entries are refreshed before they become stale. 0 disables tracking
+    std::size_t num_hot_keys{32};
+
+    // Requests are counted over the last one or two windows of this length
+    std::chrono::seconds hot_key_window{10};
+
+    // How often to rebuild the filter of existing IDs. 0 disables the filter
+    std::chrono::seconds id_filter_refresh_interval{30};
+
+    // If not zero, the server runs in mirror mode: the entire table is loaded in memory,
+    // and changes are picked up with this period
+    std::chrono::seconds mirror_sync_interval{0};
+
+    // In mirror mode, a file where the table is periodically saved.
+    // If it exists on startup, it's used to start serving requests right away. Empty to disable
+    std::string mirror_file;
+
+    // How often to save the mirror file, at most
+    std::chrono::seconds mirror_save_interval{60};
+};
+
+// The time budget for background database work that no request waits for,
+// like cache refreshes and readahead prefetches
+constexpr std::chrono::seconds background_timeout{30};
+
+// Caches prepared statements for the connections in a pool.
+// A statement is prepared the first time it's used in a connection,
+// and its handle is reused afterwards. This saves the server from
+// parsing and planning the query on every request.
+// Prepared statements are bound to the server session, so handles are discarded
+// if the connection is re-established (its connection ID changes)
+// or reset (by calling invalidate()).
+// Not thread-safe: each worker has its own cache.
+class statement_cache
+{
+    struct connection_entry
+    {
+        // The ID that the server assigned to the session
+        // where the statements were prepared
+        std::optional<std::uint32_t> connection_id;
+
+        // SQL text => prepared statement
+        std::unordered_map<std::string_view, mysql::statement> statements;
+    };
+
+    std::unordered_map<const mysql::any_connection*, connection_entry> entries_;
+
+public:
+    // Retrieves a prepared statement for the given SQL in the given connection,
+    // preparing it if required. The SQL text is used as key,
+    // so it must outlive the cache (e.g. a string literal).
+    asio::awaitable<mysql::statement> get(mysql::any_connection& conn, std::string_view sql)
+    {
+        // If the connection was re-established since we last used it,
+        // the server has already deallocated its statements
+        auto& entry = entries_[&conn];
+        if (entry.connection_id != conn.connection_id())
+        {
+            entry.statements.clear();
+            entry.connection_id = conn.connection_id();
+        }
+
+        // Cache hit
+        auto it = entry.statements.find(sql);
+        if (it != entry.statements.end())
+            co_return it->second;
+
+        // Cache miss: prepare the statement and remember it.
+        // Other coroutines may have modified the cache while we were suspended,
+        // but not our connection's entry, since we own the connection.
+        mysql::statement stmt = co_await conn.async_prepare_statement(sql);
+        entries_[&conn].statements.emplace(sql, stmt);
+        co_return stmt;
+    }
+
+    // Forgets the statements prepared in the given connection.
+    // Call this when the connection is going to be reset, since this deallocates
+    // all its prepared statements.
+    void invalidate(const mysql::any_connection& conn) { entries_.erase(&conn); }
+
+    // Executes the given SQL as a prepared statement, preparing it if required.
+    // If an error happens, the pool will reset or reconnect the connection when it's returned,
+    // so we forget its statements.
+    template <class... Params>
+    asio::awaitable<void> execute(
+        mysql::any_connection& conn,
+        std::string_view sql,
+        mysql::results& result,
+        Params... params
+    )
+    {
+        try
+        {
+            mysql::statement stmt = co_await get(conn, sql);
+            co_await conn.async_execute(stmt.bind(params...), result);
+        }
+        catch (...)
+        {
+            invalidate(conn);
+            throw;
+        }
+    }
+};
+
+// Counters updated by a single worker. They may be read from any thread.
+// Aligned to a cache line, so workers don't suffer from false sharing
+struct alignas(64) worker_metrics
+{
+    // Lookups answered with a 404 by the ID filter, without querying the database
+    std::atomic<std::uint64_t> filtered_lookups{};
+
+    // Cached responses refreshed in the background
+    std::atomic<std::uint64_t> background_refreshes{};
+
+    // Background refreshes requested for hot keys, before their entries became stale
+    std::atomic<std::uint64_t> hot_key_prefetches{};
+
+    // Range queries issued for sequential scans, the rows they loaded into the cache,
+    // and the queries skipped because requests were waiting for connections
+    std::atomic<std::uint64_t> readahead_queries{};
+    std::atomic<std::uint64_t> readahead_rows{};
+    std::atomic<std::uint64_t> readahead_skipped{};
+
+    // Requests received through the binary protocol
+    std::atomic<std::uint64_t> binary_requests{};
+
+    // HTTP requests abandoned, without writing their responses, because the client reset the connection
+    std::atomic<std::uint64_t> abandoned_requests{};
+
+    // Queries cut short by a deadline or a cancellation, and how many of them were killed in the server.
+    // Under timeout storms, these measure the work the server was spared
+    std::atomic<std::uint64_t> interrupted_queries{};
+    std::atomic<std::uint64_t> queries_killed{};
+    std::atomic<std::uint64_t> query_kill_failures{};
+
+    // Connections whose query was interrupted that were reset and reused,
+    // versus left for the pool to reconnect
+    std::atomic<std::uint64_t> connections_recovered{};
+    std::atomic<std::uint64_t> connections_reconnected{};
+};
+
+// Returns whether exc is the result of cancelling an operation (e.g. by a timeout)
+bool is_cancellation(std::exception_ptr exc)
 {
     try
     {
         std::rethrow_exception(exc);
     }
-    catch (const std::exception& err)
+    catch (const boost::system::system_error& err)
     {
-        std::cerr << "Unhandled exception: " << err.what() << std::endl;
+        return err.code() == asio::error::operation_aborted;
+    }
+    catch (...)
+    {
+        return false;
     }
 }
 
-// Validates an incoming HTTP request, extracting the employee ID that the client
-// is asking for. If the verb or target don't match what we expect,
-// returns an empty optional.
-// A more refined version could return a std::expected/boost::system::result
-// containing what went wrong, so we can return specialized responses
-// (e.g. http::verb::method_not_allowed if the method is not what we expected).
-std::optional<std::int64_t> parse_request(const http::request<http::empty_body>& req)
+// Cancelling a database operation only makes the client stop waiting:
+// the server keeps running the query, burning CPU and holding locks.
+// It also leaves the connection in an unknown protocol state, so the pool has to reconnect it.
+// The killer issues KILL QUERY statements for such connections, over a dedicated control connection,
+// which doesn't come from the pool, so it's available when the pool is exhausted.
+// Killing a query (rather than cancelling the operation running it) makes the operation
+// fail with a server error, after which the connection can be reset and reused,
+// which is much cheaper than reconnecting (see query_watch).
+// Connections are only returned to the pool once their KILL has been issued.
+// Otherwise, it could hit a query issued by the connection's next user.
+// Kills are issued one at a time, in order. Not thread-safe: each worker has its own.
+class query_killer
 {
-    constexpr std::string_view prefix = "/employee/";
+public:
+    // Queries are killed this long before their deadline (at most), so they have time to stop
+    // before the operations running them are cancelled
+    static constexpr std::chrono::seconds grace_period{1};
 
-    // Check the verb
-    if (req.method() != http::verb::get)
-        return {};
+    // A kill, issued or about to be
+    struct kill_request
+    {
+        // The session to kill the query in
+        std::uint32_t connection_id;
 
-    // Check that the target starts with the prefix
-    auto target = req.target();
-    if (!target.starts_with(prefix))
-        return {};
+        // Set once the KILL has been issued (successfully or not)
+        bool issued{};
+
+        // Set if the KILL failed or was never sent. The query may still be running,
+        // so the connection can't be reused: the pool reconnects it
+        bool failed{};
+
+        // The connection running the query, if its owner released it before the KILL was issued,
+        // and whether its protocol state is known, so it can be reset and reused
+        mysql::pooled_connection conn;
+        bool recoverable{};
+    };
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    // Kills are issued one at a time. Connections waiting for theirs are held out of the pool,
+    // so kills requested while this many are pending fail straight away
+    static constexpr std::size_t max_pending = 32;
+
+    // How long to wait before connecting again after the control connection fails to connect.
+    // Doubles with each consecutive failure
+    static constexpr std::chrono::seconds min_backoff{1};
+    static constexpr std::chrono::seconds max_backoff{30};
+
+    mysql::any_connection control_conn_;
+    mysql::connect_params params_;
+    statement_cache& statements_;
+    timer_wheel& timeouts_;
+    worker_metrics& metrics_;
+    std::deque<std::shared_ptr<kill_request>> pending_;
+    bool connected_{};
+    bool running_{};
+
+    // While backing off, kills fail without attempting to connect
+    clock::duration backoff_{};
+    clock::time_point retry_at_{};
+
+    // Marks a kill as done, returning its connection to the pool if it has been released
+    void finish(kill_request& req)
+    {
+        req.issued = true;
+        if (req.conn.valid())
+            recover(req.conn, req.recoverable && !req.failed);
+    }
+
+    // Marks a kill as failed without issuing it
+    void fail(kill_request& req)
+    {
+        metrics_.query_kill_failures.fetch_add(1, std::memory_order_relaxed);
+        req.failed = true;
+        finish(req);
+    }
+
+    // Issues the pending kills, connecting the control connection if required
+    asio::awaitable<void> run()
+    {
+        using namespace std::chrono_literals;
+
+        while (!pending_.empty())
+        {
+            // If the server is unreachable, each pending kill would wait for a connect to time out,
+            // holding its connection. Fail them all instead, returning their connections to the pool
+            // (which reconnects them), and back off
+            bool connect_failed = false;
+            if (!connected_)
+            {
+                try
+                {
+                    co_await control_conn_.async_connect(params_, wheel_cancel_after(timeouts_, 5s));
+                    connected_ = true;
+                    backoff_ = {};
+                }
+                catch (const std::exception& err)
+                {
+                    std::cerr << "Error connecting to kill queries: " << err.what() << std::endl;
+                    connect_failed = true;
+                }
+            }
+            if (connect_failed)
+            {
+                backoff_ = std::clamp<clock::duration>(backoff_ * 2, min_backoff, max_backoff);
+                retry_at_ = clock::now() + backoff_;
+                while (!pending_.empty())
+                {
+                    fail(*pending_.front());
+                    pending_.pop_front();
+                }
+                break;
+            }
+
+            std::shared_ptr<kill_request> req = std::move(pending_.front());
+            pending_.pop_front();
+            try
+            {
+                mysql::results result;
+                co_await control_conn_.async_execute(
+                    mysql::with_params("KILL QUERY {}", req->connection_id),
+                    result,
+                    wheel_cancel_after(timeouts_, 5s)
+                );
+                metrics_.queries_killed.fetch_add(1, std::memory_order_relaxed);
+            }
+            catch (const std::exception& err)
+            {
+                // The control connection is reconnected for the next kill
+                std::cerr << "Error killing query: " << err.what() << std::endl;
+                metrics_.query_kill_failures.fetch_add(1, std::memory_order_relaxed);
+                req->failed = true;
+                connected_ = false;
+            }
+            finish(*req);
+        }
+        running_ = false;
+    }
+
+    // Resets a connection whose query was killed, and returns it to the pool.
+    // The reset's response also tells us that the connection is alive
+    asio::awaitable<void> reset(mysql::pooled_connection conn)
+    {
+        using namespace std::chrono_literals;
+
+        try
+        {
+            co_await conn->async_reset_connection(wheel_cancel_after(timeouts_, 5s));
+            conn.return_without_reset();
+            metrics_.connections_recovered.fetch_add(1, std::memory_order_relaxed);
+        }
+        catch (const std::exception&)
+        {
+            // The pool will reconnect it
+            metrics_.connections_reconnected.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns a connection whose query was killed to the pool, resetting it if possible
+    void recover(mysql::pooled_connection& conn, bool recoverable)
+    {
+        // Resetting or reconnecting deallocates the connection's prepared statements
+        statements_.invalidate(conn.get());
+        if (recoverable)
+        {
+            asio::co_spawn(control_conn_.get_executor(), reset(std::move(conn)), asio::detached);
+        }
+        else
+        {
+            // Destroying it returns it to the pool, which will reconnect it
+            metrics_.connections_reconnected.fetch_add(1, std::memory_order_relaxed);
+            mysql::pooled_connection released = std::move(conn);
+        }
+    }
+
+public:
+    query_killer(
+        asio::any_io_executor ex,
+        const mysql::pool_params& params,
+        statement_cache& statements,
+        timer_wheel& timeouts,
+        worker_metrics& metrics
+    )
+        : control_conn_(std::move(ex)),
+          params_{
+              .server_address = params.server_address,
+              .username = params.username,
+              .password = params.password,
+              .database = params.database,
+              .ssl = params.ssl,
+          },
+          statements_(statements),
+          timeouts_(timeouts),
+          metrics_(metrics)
+    {
+    }
+
+    // Requests killing the query running in conn. The connection must be handed back
+    // with release() once its owner is done with it. Returns null if conn has no session
+    std::shared_ptr<kill_request> kill(const mysql::any_connection& conn)
+    {
+        metrics_.interrupted_queries.fetch_add(1, std::memory_order_relaxed);
+        auto id = conn.connection_id();
+        if (!id)
+            return nullptr;
+
+        auto req = std::make_shared<kill_request>();
+        req->connection_id = *id;
+
+        // Don't hold the connection waiting for a kill that can't be issued soon
+        if (pending_.size() >= max_pending || clock::now() < retry_at_)
+        {
+            fail(*req);
+            return req;
+        }
+
+        pending_.push_back(req);
+        if (!running_)
+        {
+            running_ = true;
+            asio::co_spawn(control_conn_.get_executor(), run(), asio::detached);
+        }
+        return req;
+    }
+
+    // Takes ownership of a connection whose query is being killed by req, returning it
+    // to the pool once the KILL has been issued. If recoverable, its protocol state is known
+    // (i.e. no operation on it was cancelled), so it's reset and reused instead of reconnected,
+    // unless the KILL failed
+    void release(kill_request& req, mysql::pooled_connection& conn, bool recoverable)
+    {
+        if (req.issued)
+        {
+            recover(conn, recoverable && !req.failed);
+        }
+        else
+        {
+            req.conn = std::move(conn);
+            req.recoverable = recoverable;
+        }
+    }
+
+    // Call when an operation on conn failed with exc, for operations without a query_watch.
+    // If the operation was cancelled, the server may still be running its query:
+    // takes ownership of conn, kills the query and returns conn to the pool afterwards.
+    // Otherwise, conn is left untouched.
+    void kill_if_cancelled(mysql::pooled_connection& conn, std::exception_ptr exc)
+    {
+        if (!conn.valid() || !is_cancellation(exc))
+            return;
+        if (auto req = kill(conn.get()))
+            release(*req, conn, false);
+    }
+};
+
+class query_watch;
+
+// The query watches of a session's requests, so their queries can be killed straight away
+// if the client goes away (see watch_peer). Not thread-safe.
+class query_watch_list
+{
+    std::vector<query_watch*> watches_;
+    bool abandoned_{};
+
+public:
+    // Called by query_watch. Queries started after the requests were abandoned are killed right away
+    void add(query_watch& watch);
+    void remove(query_watch& watch) { std::erase(watches_, &watch); }
+
+    // Kills the queries being watched, and the ones started later. Returns how many were being watched
+    std::size_t abandon();
+
+    // Whether abandon() has been called
+    bool abandoned() const { return abandoned_; }
+};
+
+// Kills the queries run on a pooled connection if they're still running shortly before a deadline
+// (see query_killer::grace_period), or when the requests running them are abandoned (see query_watch_list).
+// The operation running the query fails with a server error, and the connection is reset and reused,
+// rather than cancelled at the deadline and reconnected.
+// Operations should still be cancelled at the deadline, in case the server doesn't react.
+// Create it once the connection is checked out, and return the connection through
+// release() or release_after_error(). Not thread-safe.
+class query_watch
+{
+    query_killer& killer_;
+    timer_wheel& timeouts_;
+    mysql::pooled_connection& conn_;
+    query_watch_list* list_;
+    timer_wheel::entry* entry_{};
+    std::shared_ptr<query_killer::kill_request> kill_;
+
+    void start_kill()
+    {
+        if (!kill_)
+            kill_ = killer_.kill(conn_.get());
+    }
+
+public:
+    query_watch(
+        query_killer& killer,
+        timer_wheel& timeouts,
+        mysql::pooled_connection& conn,
+        timer_wheel::clock::time_point deadline,
+        query_watch_list* list = nullptr
+    )
+        : killer_(killer), timeouts_(timeouts), conn_(conn), list_(list)
+    {
+        // Leave most of the remaining time to the query if the deadline is close
+        auto remaining = deadline - timer_wheel::clock::now();
+        auto grace = std::min<timer_wheel::clock::duration>(query_killer::grace_period, remaining / 4);
+        entry_ = timeouts_.arm(remaining - grace, asio::cancellation_type::terminal);
+        entry_->signal.slot().assign([this](asio::cancellation_type) { start_kill(); });
+        if (list_)
+            list_->add(*this);
+    }
+
+    query_watch(const query_watch&) = delete;
+    query_watch& operator=(const query_watch&) = delete;
+
+    // If the connection wasn't released (e.g. because of an unexpected exception),
+    // it must not be returned to the pool before its KILL is issued
+    ~query_watch()
+    {
+        disarm();
+        if (kill_ && conn_.valid())
+            killer_.release(*kill_, conn_, false);
+    }
+
+    // Stops watching: queries won't be killed anymore.
+    // The connection must still be returned through this object
+    void disarm()
+    {
+        if (entry_)
+            timeouts_.release(std::exchange(entry_, nullptr));
+        if (list_)
+            std::exchange(list_, nullptr)->remove(*this);
+    }
+
+    // Kills the query now, rather than before the deadline. Does nothing if it's being killed already
+    void kill()
+    {
+        disarm();
+        start_kill();
+    }
+
+    // Returns the connection to the pool once its operations have succeeded.
+    // A kill may have been issued anyway, in which case the connection is reset
+    void release()
+    {
+        disarm();
+        if (kill_)
+            killer_.release(*kill_, conn_, true);
+        else
+            conn_.return_without_reset();
+    }
+
+    // Call when an operation on the connection failed with exc.
+    // Ensures that the server isn't running its query anymore, returning the connection to the pool.
+    // Errors other than cancellations (e.g. the server error caused by a kill) leave the connection
+    // usable. Otherwise, the connection is left untouched, and the pool resets it when it's destroyed
+    void release_after_error(std::exception_ptr exc)
+    {
+        disarm();
+        if (!conn_.valid())
+            return;
+        bool cancelled = is_cancellation(exc);
+        if (!kill_ && cancelled)
+            kill_ = killer_.kill(conn_.get());
+        if (kill_)
+            killer_.release(*kill_, conn_, !cancelled);
+    }
+};
+
+void query_watch_list::add(query_watch& watch)
+{
+    if (abandoned_)
+        watch.kill();
+    else
+        watches_.push_back(&watch);
+}
+
+std::size_t query_watch_list::abandon()
+{
+    abandoned_ = true;
+
+    // Killing a query removes it from the list
+    std::size_t num_killed = watches_.size();
+    while (!watches_.empty())
+        watches_.back()->kill();
+    return num_killed;
+}
+
+// Coalesces concurrent lookups for the same key ("singleflight").
+// The first coroutine asking for a key runs the lookup, and coroutines asking for
+// the same key while the lookup is in progress wait for its result,
+// rather than issuing an identical query.
+// Cancelling a waiter doesn't affect the others. The shared lookup is only
+// cancelled when all its waiters have been cancelled.
+// Not thread-safe: each worker has its own.
+template <class Key, class Value>
+class singleflight
+{
+    // A lookup in progress
+    struct flight
+    {
+        // Waiters wait on this timer, which never expires.
+        // Cancelling it notifies them that the lookup finished
+        asio::steady_timer done;
+
+        // Emitted to cancel the lookup
+        asio::cancellation_signal cancel_signal;
+
+        // The number of coroutines waiting for this lookup
+        std::size_t num_waiters{};
+
+        // The outcome of the lookup. Valid once finished is true
+        bool finished{};
+        std::exception_ptr exc;
+        std::optional<Value> result;
+
+        flight(asio::any_io_executor ex) : done(std::move(ex), asio::steady_timer::time_point::max()) {}
+    };
+
+    std::unordered_map<Key, std::shared_ptr<flight>> flights_;
+
+    // Removes f from the table, unless it was already replaced by a newer flight
+    void remove(const Key& key, const flight* f)
+    {
+        auto it = flights_.find(key);
+        if (it != flights_.end() && it->second.get() == f)
+            flights_.erase(it);
+    }
+
+public:
+    // Retrieves the value for key. If there's no lookup in progress for key,
+    // calls fn() to start one. fn() must return an asio::awaitable<Value>.
+    // The lookup runs in its own coroutine, detached from the caller's.
+    template <class Function>
+    asio::awaitable<Value> get(Key key, Function fn)
+    {
+        std::shared_ptr<flight> f = flights_[key];
+        if (!f)
+        {
+            auto ex = co_await asio::this_coro::executor;
+            f = std::make_shared<flight>(ex);
+            flights_[key] = f;
+
+            // Launch the lookup. Our cancellation slot is not propagated to it,
+            // so cancelling this coroutine doesn't cancel the lookup.
+            asio::co_spawn(
+                ex,
+                fn(),
+                asio::bind_cancellation_slot(
+                    f->cancel_signal.slot(),
+                    [this, key, f](std::exception_ptr exc, Value value) {
+                        f->finished = true;
+                        f->exc = std::move(exc);
+                        if (!f->exc)
+                            f->result = std::move(value);
+                        remove(key, f.get());
+                        f->done.cancel();
+                    }
+                )
+            );
+        }
+
+        // Wait for the lookup to finish. asio::as_tuple prevents exceptions,
+        // since the timer always completes with an error
+        ++f->num_waiters;
+        co_await f->done.async_wait(asio::as_tuple(asio::use_awaitable));
+        --f->num_waiters;
+
+        // If the lookup didn't finish, we were cancelled.
+        // If nobody else is interested, cancel the lookup, too.
+        // New requests for this key will start a new lookup.
+        if (!f->finished)
+        {
+            if (f->num_waiters == 0)
+            {
+                remove(key, f.get());
+                f->cancel_signal.emit(asio::cancellation_type::terminal);
+            }
+            throw boost::system::system_error(asio::error::operation_aborted);
+        }
+
+        if (f->exc)
+            std::rethrow_exception(f->exc);
+        co_return *f->result;
+    }
+};
+
+// The time left until the deadline, in milliseconds, for a MAX_EXECUTION_TIME optimizer hint.
+// Queries that can't be bounded by the client alone (e.g. scans) pass their budget to MySQL this way,
+// so it gives up on work nobody will wait for. The hint doesn't accept zero, which means no limit
+std::chrono::milliseconds::rep execution_budget(std::chrono::steady_clock::time_point deadline)
+{
+    auto budget = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now()
+    );
+    return std::max<std::chrono::milliseconds::rep>(budget.count(), 1);
+}
+
+// Retrieves the subjects for the given IDs with a single query.
+// IDs that don't exist are not present in the result.
+// Nobody waits for the result after the deadline, so MySQL is told to give up by then
+asio::awaitable<std::unordered_map<std::int64_t, std::string>> query_subjects(
+    mysql::any_connection& conn,
+    statement_cache& statements,
+    std::span<const std::int64_t> ids,
+    std::chrono::steady_clock::time_point deadline
+)
+{
+    mysql::results result;
+    if (ids.size() == 1)
+    {
+        // Single lookups can use a prepared statement. Its text can't include the deadline
+        // without defeating statement caching, but a primary key lookup can't run for long anyway
+        co_await statements.execute(
+            conn,
+            "SELECT id, subject FROM correlations WHERE id = ?",
+            result,
+            ids.front()
+        );
+    }
+    else
+    {
+        // The number of IDs varies between batches, so we can't use a prepared statement.
+        // Ranges are formatted as comma-separated lists. The remaining time budget
+        // is passed as an optimizer hint
+        try
+        {
+            co_await conn.async_execute(
+                mysql::with_params(
+                    "SELECT /*+ MAX_EXECUTION_TIME({}) */ id, subject FROM correlations WHERE id IN ({})",
+                    execution_budget(deadline),
+                    ids
+                ),
+                result
+            );
+        }
+        catch (...)
+        {
+            // The pool will reset the connection, deallocating its statements
+            statements.invalidate(conn);
+            throw;
+        }
+    }
+
+    std::unordered_map<std::int64_t, std::string> subjects;
+    for (auto row : result.rows())
+        subjects.emplace(row.at(0).as_int64(), row.at(1).as_string());
+    co_return subjects;
+}
+
+// Gives requests priority over background work when checking out connections.
+// Requests check out connections through this class, and background work waits
+// until none of them is waiting for a connection before checking one out.
+// Not thread-safe: each worker has its own.
+class checkout_priority
+{
+    mysql::connection_pool& pool_;
+
+    // The number of requests waiting for a connection
+    std::size_t num_waiting_{};
+
+    // Background work waits on this timer, which never expires.
+    // Cancelling it notifies it that no request is waiting
+    asio::steady_timer idle_;
+
+    void finish_waiting()
+    {
+        if (--num_waiting_ == 0)
+            idle_.cancel();
+    }
+
+public:
+    checkout_priority(mysql::connection_pool& pool, asio::any_io_executor ex)
+        : pool_(pool), idle_(std::move(ex))
+    {
+    }
+
+    // Checks out a connection on behalf of a request. token is passed to async_get_connection,
+    // and is usually a timeout
+    template <class CompletionToken = asio::deferred_t>
+    asio::awaitable<mysql::pooled_connection> get_connection(CompletionToken token = {})
+    {
+        ++num_waiting_;
+        mysql::pooled_connection conn;
+        try
+        {
+            conn = co_await pool_.async_get_connection(std::move(token));
+        }
+        catch (...)
+        {
+            finish_waiting();
+            throw;
+        }
+        finish_waiting();
+        co_return conn;
+    }
+
+    // Whether any request is waiting for a connection
+    bool busy() const { return num_waiting_ != 0; }
+
+    // Waits until no request is waiting for a connection
+    asio::awaitable<void> wait_idle()
+    {
+        while (num_waiting_ != 0)
+        {
+            idle_.expires_at(asio::steady_timer::time_point::max());
+            co_await idle_.async_wait(asio::as_tuple(asio::use_awaitable));
+        }
+    }
+};
+
+// Groups lookups for different IDs into batches ("micro-batching"),
+// so a single query retrieves the subjects for many IDs.
+// A batch is dispatched when it's full, or when its time window elapses.
+// The window adapts to load: if lookups arrive too far apart for
+// the batch to collect several of them, waiting is pointless,
+// so lookups are dispatched immediately and low traffic doesn't pay extra latency.
+// Not thread-safe: each worker has its own.
+class lookup_batcher
+{
+    using clock = std::chrono::steady_clock;
+
+    // A group of lookups that will be run by a single query
+    struct batch
+    {
+        // The IDs to look up
+        std::vector<std::int64_t> ids;
+
+        // The latest deadline of the lookups in the batch.
+        // The query is cancelled if it's not done by then
+        clock::time_point deadline{};
+
+        // Waiters wait on this timer, which never expires.
+        // Cancelling it notifies them that the query finished
+        asio::steady_timer done;
+
+        // The outcome of the query. Valid once finished is true.
+        // IDs that don't exist are not present in subjects.
+        bool finished{};
+        std::exception_ptr exc;
+        std::unordered_map<std::int64_t, std::string> subjects;
+
+        batch(asio::any_io_executor ex) : done(std::move(ex), asio::steady_timer::time_point::max()) {}
+    };
+
+    checkout_priority& checkouts_;
+    statement_cache& statements_;
+    query_killer& killer_;
+    timer_wheel& timeouts_;
+    std::size_t max_batch_size_;
+    clock::duration max_window_;
+
+    // The batch that is collecting IDs, if any
+    std::shared_ptr<batch> open_batch_;
+
+    // Fires when the open batch's window elapses
+    std::optional<asio::steady_timer> window_timer_;
+
+    // Exponentially weighted moving average of the time between lookups
+    clock::duration avg_interarrival_{std::chrono::seconds(1)};
+    clock::time_point last_arrival_{};
+
+    // Updates the moving average with a new arrival, and computes
+    // how long a new batch should wait for more lookups
+    clock::duration compute_window()
+    {
+        auto now = clock::now();
+        auto interarrival = std::min<clock::duration>(now - last_arrival_, std::chrono::seconds(1));
+        last_arrival_ = now;
+        avg_interarrival_ = (avg_interarrival_ * 7 + interarrival) / 8;
+
+        // If we don't expect at least a couple more lookups within
+        // the maximum window, batching is not worth the extra latency
+        if (avg_interarrival_ * 2 > max_window_)
+            return clock::duration::zero();
+
+        // Otherwise, wait approximately the time required to fill the batch
+        return std::min(max_window_, avg_interarrival_ * static_cast<int>(max_batch_size_ - 1));
+    }
+
+    // Runs the query for a batch, notifying waiters when done
+    static asio::awaitable<void> run_batch(
+        checkout_priority& checkouts,
+        statement_cache& statements,
+        query_killer& killer,
+        timer_wheel& timeouts,
+        std::shared_ptr<batch> b
+    )
+    {
+        mysql::pooled_connection conn;
+        std::optional<query_watch> watch;
+        try
+        {
+            conn = co_await checkouts.get_connection();
+
+            // If the query is about to miss the deadline, kill it, so the connection can be reused
+            watch.emplace(killer, timeouts, conn, b->deadline);
+            b->subjects = co_await query_subjects(conn.get(), statements, b->ids, b->deadline);
+
+            // Connections are reset when returned to the pool by default, which deallocates
+            // their prepared statements. We only read data, so there's no session state to clean up
+            watch->release();
+        }
+        catch (...)
+        {
+            b->exc = std::current_exception();
+            if (watch)
+                watch->release_after_error(b->exc);
+        }
+
+        // Notify waiters
+        b->finished = true;
+        b->done.cancel();
+    }
+
+    // Launches the query for the open batch
+    void dispatch()
+    {
+        auto b = std::move(open_batch_);
+        open_batch_.reset();
+        if (window_timer_)
+            window_timer_->cancel();
+
+        // The batch query is shared by many lookups, so it's not a child of any of them:
+        // cancelling a lookup doesn't cancel the query. It's cancelled once
+        // none of them would wait for it anymore, instead
+        asio::co_spawn(
+            b->done.get_executor(),
+            run_batch(checkouts_, statements_, killer_, timeouts_, b),
+            wheel_cancel_at(timeouts_, b->deadline, asio::detached)
+        );
+    }
+
+public:
+    lookup_batcher(
+        checkout_priority& checkouts,
+        statement_cache& statements,
+        query_killer& killer,
+        timer_wheel& timeouts,
+        std::size_t max_batch_size,
+        clock::duration max_window
+    )
+        : checkouts_(checkouts),
+          statements_(statements),
+          killer_(killer),
+          timeouts_(timeouts),
+          max_batch_size_(max_batch_size),
+          max_window_(max_window)
+    {
+    }
+
+    // Retrieves the subject of the correlation with the given ID.
+    // Returns an empty optional if the correlation doesn't exist.
+    // The lookup is not needed after the deadline.
+    asio::awaitable<std::optional<std::string>> load(std::int64_t id, clock::time_point deadline)
+    {
+        auto ex = co_await asio::this_coro::executor;
+        auto window = compute_window();
+
+        // Join the open batch, or open a new one
+        bool is_new_batch = !open_batch_;
+        if (is_new_batch)
+            open_batch_ = std::make_shared<batch>(ex);
+        auto b = open_batch_;
+        b->ids.push_back(id);
+        b->deadline = std::max(b->deadline, deadline);
+
+        // Dispatch the batch if it's full or there's no point in waiting.
+        // Otherwise, a new batch waits for its window to elapse
+        if (b->ids.size() >= max_batch_size_ || window == clock::duration::zero())
+        {
+            dispatch();
+        }
+        else if (is_new_batch)
+        {
+            if (!window_timer_)
+                window_timer_.emplace(ex);
+            window_timer_->expires_after(window);
+            window_timer_->async_wait([this, b](error_code) {
+                // The batch may have already been dispatched because it became full
+                if (open_batch_ == b)
+                    dispatch();
+            });
+        }
+
+        // Wait for the query to finish. asio::as_tuple prevents exceptions,
+        // since the timer always completes with an error
+        co_await b->done.async_wait(asio::as_tuple(asio::use_awaitable));
+
+        // If the query didn't finish, we were cancelled.
+        // The query keeps running for the rest of lookups in the batch
+        if (!b->finished)
+            throw boost::system::system_error(asio::error::operation_aborted);
+        if (b->exc)
+            std::rethrow_exception(b->exc);
+
+        auto it = b->subjects.find(id);
+        if (it == b->subjects.end())
+            co_return std::nullopt;
+        co_return it->second;
+    }
+};
+
+// Computes the index of a key's counter in the given row of a count-min sketch.
+// width must be a power of two. The key's hash is remixed with a different seed
+// for each row (using the splitmix64 finalizer), so the rows index independently:
+// keys colliding in one row are unlikely to collide in the others
+std::size_t sketch_index(std::uint64_t hash, std::size_t row, std::size_t width)
+{
+    std::uint64_t x = hash ^ (0x9e3779b97f4a7c15ull * (row + 1));
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return static_cast<std::size_t>(x & (width - 1));
+}
+
+// Estimates how frequently keys are accessed, using little memory.
+// This is a count-min sketch with 4-bit counters, as used by TinyLFU.
+// Counters are halved periodically, so estimates favor recent history.
+class frequency_sketch
+{
+    static constexpr std::size_t depth = 4;
+    static constexpr std::uint8_t max_count = 15;
+
+    std::size_t width_;
+    std::vector<std::uint8_t> counters_;
+    std::size_t additions_{};
+    std::size_t sample_size_;
+
+    std::uint8_t& counter(std::uint64_t hash, std::size_t row)
+    {
+        return counters_[row * width_ + sketch_index(hash, row, width_)];
+    }
+
+    // Ages all counters
+    void halve()
+    {
+        for (auto& c : counters_)
+            c >>= 1;
+        additions_ /= 2;
+    }
+
+public:
+    // width is the number of counters per row. It should be close to the
+    // number of keys that the cache may hold
+    explicit frequency_sketch(std::size_t width)
+        : width_(std::bit_ceil(std::max<std::size_t>(width, 64))),
+          counters_(depth * width_),
+          sample_size_(10 * width_)
+    {
+    }
+
+    // Records an access to the key with the given hash
+    void increment(std::uint64_t hash)
+    {
+        bool added = false;
+        for (std::size_t row = 0; row < depth; ++row)
+        {
+            auto& c = counter(hash, row);
+            if (c < max_count)
+            {
+                ++c;
+                added = true;
+            }
+        }
+        if (added && ++additions_ >= sample_size_)
+            halve();
+    }
+
+    // Estimates the number of recent accesses to the key with the given hash
+    unsigned estimate(std::uint64_t hash)
+    {
+        std::uint8_t res = max_count;
+        for (std::size_t row = 0; row < depth; ++row)
+            res = std::min(res, counter(hash, row));
+        return res;
+    }
+};
+
+// Mixes the bits of an integer, so that consecutive IDs
+// don't end up in consecutive shards or counters (splitmix64)
+std::uint64_t hash_id(std::int64_t id)
+{
+    auto x = static_cast<std::uint64_t>(id) + 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// An HTTP response rendered ahead of time, so it can be cached
+// and written to the socket without formatting or copying anything.
+// It contains everything but the HTTP version and the Connection header,
+// which depend on the request, and are supplied when the response is written.
+// Immutable once built, so it can be shared between threads.
+class serialized_response
+{
+    // The status line without the version and the fixed headers,
+    // followed by the blank line ending the headers and the body
+    std::string data_;
+    std::size_t head_size_;
+
+public:
+    serialized_response(http::status status, std::string_view body)
+    {
+        data_.push_back(' ');
+        data_.append(std::to_string(static_cast<unsigned>(status)));
+        data_.push_back(' ');
+        auto reason = http::obsolete_reason(status);
+        data_.append(reason.data(), reason.size());
+        data_.append("\r\nContent-Length: ");
+        data_.append(std::to_string(body.size()));
+        data_.append("\r\n");
+        head_size_ = data_.size();
+        data_.append("\r\n");
+        data_.append(body);
+    }
+
+    // Everything after the HTTP version, up to the headers that depend on the request
+    asio::const_buffer head() const { return asio::buffer(data_.data(), head_size_); }
+
+    // The end of the headers and the body
+    asio::const_buffer tail() const
+    {
+        return asio::buffer(data_.data() + head_size_, data_.size() - head_size_);
+    }
+
+    // The body alone
+    std::string_view body() const { return std::string_view(data_).substr(head_size_ + 2); }
+
+    // Total size of the response, excluding the parts that depend on the request
+    std::size_t size() const { return data_.size(); }
+};
+
+// A sharded, in-memory, read-through cache for correlation responses.
+// Keys are spread between shards by hash, and each shard is protected by its own mutex.
+// There is no global lock: threads only contend if they access the same shard at once.
+// Each shard keeps its entries in LRU order and has a fixed share of the memory budget.
+// Entries are fresh for a fixed time to live. After that, they're stale for up to
+// a maximum staleness: they are still served, but should be refreshed
+// in the background (stale-while-revalidate). Then they expire.
+// A single lookup is asked to refresh a stale entry, so a popular entry
+// doesn't cause a refresh per request.
+// When a shard is full, a new key is only admitted if it has been requested
+// more frequently than the entry it would evict (TinyLFU admission),
+// so scanning rarely-used keys doesn't evict hot ones.
+// Thread-safe: it's shared by all workers.
+class response_cache
+{
+public:
+    // Counters describing the cache's behavior
+    struct stats
+    {
+        std::uint64_t hits{};
+        std::uint64_t stale_hits{};
+        std::uint64_t misses{};
+        std::uint64_t admissions{};
+        std::uint64_t rejections{};
+        std::uint64_t evictions{};
+    };
+
+    // The outcome of a lookup
+    struct lookup_result
+    {
+        // Null on a miss
+        std::shared_ptr<const serialized_response> response;
+
+        // If true, the entry is stale and the caller should refresh it
+        bool needs_refresh{};
+    };
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    // Approximate memory used by an entry, excluding the response itself
+    static constexpr std::size_t entry_overhead = 128;
+
+    // If a stale entry hasn't been refreshed after this time, another refresh is requested
+    static constexpr clock::duration refresh_retry_interval = std::chrono::seconds(30);
+
+    struct entry
+    {
+        std::int64_t id;
+        std::shared_ptr<const serialized_response> response;
+        clock::time_point stale_at;
+        clock::time_point expires_at;
+
+        // When to request the next refresh, once stale
+        clock::time_point next_refresh_at;
+
+        std::size_t charge() const { return entry_overhead + response->size(); }
+    };
+
+    struct shard
+    {
+        std::mutex mtx;
+
+        // Most recently used entries go first
+        std::list<entry> lru;
+        std::unordered_map<std::int64_t, std::list<entry>::iterator> index;
+        std::size_t bytes{};
+        frequency_sketch sketch;
+
+        // Only modified while holding mtx, but read without it by get_stats()
+        std::atomic<std::uint64_t> hits{}, stale_hits{}, misses{}, admissions{}, rejections{}, evictions{};
+
+        explicit shard(std::size_t sketch_width) : sketch(sketch_width) {}
+
+        void erase(std::list<entry>::iterator it)
+        {
+            bytes -= it->charge();
+            index.erase(it->id);
+            lru.erase(it);
+        }
+    };
+
+    std::vector<std::unique_ptr<shard>> shards_;
+    std::size_t shard_budget_;
+    clock::duration ttl_;
+    clock::duration max_staleness_;
+
+    shard& shard_for(std::uint64_t hash) { return *shards_[(hash >> 48) % shards_.size()]; }
+
+    static void bump(std::atomic<std::uint64_t>& counter) { counter.fetch_add(1, std::memory_order_relaxed); }
+
+public:
+    response_cache(
+        std::size_t memory_budget,
+        clock::duration ttl,
+        clock::duration max_staleness,
+        std::size_t num_shards = 64
+    )
+        : shard_budget_(memory_budget / num_shards), ttl_(ttl), max_staleness_(max_staleness)
+    {
+        // Size the frequency sketches for the number of entries we expect to hold
+        std::size_t expected_entries = shard_budget_ / (entry_overhead + 64);
+        shards_.reserve(num_shards);
+        for (std::size_t i = 0; i < num_shards; ++i)
+            shards_.push_back(std::make_unique<shard>(expected_entries));
+    }
+
+    // Retrieves the response for the given ID, if it's cached
+    lookup_result get(std::int64_t id)
+    {
+        auto hash = hash_id(id);
+        auto& s = shard_for(hash);
+        std::lock_guard<std::mutex> guard(s.mtx);
+
+        // Every access counts towards the key's frequency, including misses
+        s.sketch.increment(hash);
+
+        auto it = s.index.find(id);
+        if (it == s.index.end())
+        {
+            bump(s.misses);
+            return {};
+        }
+        auto now = clock::now();
+        if (it->second->expires_at <= now)
+        {
+            s.erase(it->second);
+            bump(s.misses);
+            return {};
+        }
+
+        // Mark the entry as the most recently used
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        entry& e = *it->second;
+        if (e.stale_at > now)
+        {
+            bump(s.hits);
+            return {e.response, false};
+        }
+
+        // Stale entry. Only request a refresh once in a while
+        bump(s.stale_hits);
+        bool needs_refresh = e.next_refresh_at <= now;
+        if (needs_refresh)
+            e.next_refresh_at = now + refresh_retry_interval;
+        return {e.response, needs_refresh};
+    }
+
+    // Requests a refresh for the given ID ahead of time: if its entry becomes stale
+    // within horizon and no refresh has been requested yet, returns true,
+    // and the caller should refresh the entry
+    bool claim_refresh(std::int64_t id, clock::duration horizon)
+    {
+        auto& s = shard_for(hash_id(id));
+        std::lock_guard<std::mutex> guard(s.mtx);
+
+        auto it = s.index.find(id);
+        if (it == s.index.end())
+            return false;
+        entry& e = *it->second;
+        auto now = clock::now();
+        if (e.expires_at <= now || e.next_refresh_at > now + horizon)
+            return false;
+        e.next_refresh_at = now + refresh_retry_interval;
+        return true;
+    }
+
+    // Removes the entry for the given ID, if any
+    void erase(std::int64_t id)
+    {
+        auto& s = shard_for(hash_id(id));
+        std::lock_guard<std::mutex> guard(s.mtx);
+        if (auto it = s.index.find(id); it != s.index.end())
+            s.erase(it->second);
+    }
+
+    // Stores the response for the given ID, if the admission policy allows it
+    void put(std::int64_t id, std::shared_ptr<const serialized_response> response)
+    {
+        auto hash = hash_id(id);
+        auto& s = shard_for(hash);
+        auto stale_at = clock::now() + ttl_;
+        auto expires_at = stale_at + max_staleness_;
+        std::lock_guard<std::mutex> guard(s.mtx);
+        auto existing = s.index.find(id);
+
+        // Entries that would never fit are not admitted. A previous version is outdated, so it goes too
+        std::size_t charge = entry_overhead + response->size();
+        if (charge > shard_budget_)
+        {
+            if (existing != s.index.end())
+                s.erase(existing->second);
+            bump(s.rejections);
+            return;
+        }
+
+        if (existing != s.index.end())
+        {
+            // Updates (e.g. refreshes) of cached keys are always admitted: they've already earned their place
+            s.erase(existing->second);
+        }
+        else
+        {
+            // The new entry evicts the least recently used ones. Expired entries can always be evicted.
+            // Live ones only if the new entry is more popular than them.
+            // Admission is checked against all the victims before evicting any,
+            // so a rejected entry doesn't evict anything
+            unsigned frequency = s.sketch.estimate(hash);
+            auto now = clock::now();
+            std::size_t bytes = s.bytes;
+            for (auto victim = s.lru.rbegin(); bytes + charge > shard_budget_; ++victim)
+            {
+                if (victim->expires_at > now && s.sketch.estimate(hash_id(victim->id)) >= frequency)
+                {
+                    bump(s.rejections);
+                    return;
+                }
+                bytes -= victim->charge();
+            }
+        }
+
+        // Make room for the new entry
+        while (s.bytes + charge > shard_budget_)
+        {
+            s.erase(std::prev(s.lru.end()));
+            bump(s.evictions);
+        }
+
+        // Insert the entry
+        s.lru.push_front(entry{id, std::move(response), stale_at, expires_at, stale_at});
+        s.index.emplace(id, s.lru.begin());
+        s.bytes += charge;
+        bump(s.admissions);
+    }
+
+    // Retrieves the cache's counters, aggregated across shards
+    stats get_stats() const
+    {
+        stats res;
+        for (const auto& s : shards_)
+        {
+            res.hits += s->hits.load(std::memory_order_relaxed);
+            res.stale_hits += s->stale_hits.load(std::memory_order_relaxed);
+            res.misses += s->misses.load(std::memory_order_relaxed);
+            res.admissions += s->admissions.load(std::memory_order_relaxed);
+            res.rejections += s->rejections.load(std::memory_order_relaxed);
+            res.evictions += s->evictions.load(std::memory_order_relaxed);
+        }
+        return res;
+    }
+};
+
+// The set of IDs that existed in the database when a snapshot was taken,
+// used to answer lookups for non-existent IDs without querying the database.
+// IDs are stored in a Bloom filter, which may yield false positives
+// (lookups for these will reach the database), but never false negatives.
+// The filter is only trusted up to a bound ID, since rows with greater IDs
+// may have been inserted after the snapshot was taken.
+// Immutable once built, so it can be shared between threads.
+class id_filter
+{
+    // Yields a false positive rate around 1%
+    static constexpr std::size_t bits_per_id = 10;
+    static constexpr unsigned num_hashes = 7;
+
+    std::int64_t bound_;
+    std::vector<std::uint64_t> words_;
+    std::uint64_t bit_mask_;
+
+    // Calls fn with the position of each of the bits that represent an ID.
+    // Uses double hashing to derive num_hashes positions from a single hash
+    template <class Function>
+    void for_each_bit(std::int64_t id, Function fn) const
+    {
+        std::uint64_t h1 = hash_id(id);
+        std::uint64_t h2 = (h1 >> 32) | 1u;
+        for (unsigned i = 0; i < num_hashes; ++i)
+            fn((h1 + i * h2) & bit_mask_);
+    }
+
+public:
+    // expected_ids is used to size the filter.
+    // Lookups for IDs greater than bound always reach the database.
+    id_filter(std::size_t expected_ids, std::int64_t bound)
+        : bound_(bound),
+          words_(std::bit_ceil(std::max<std::size_t>(expected_ids * bits_per_id, 64)) / 64),
+          bit_mask_(words_.size() * 64 - 1)
+    {
+    }
+
+    std::int64_t bound() const { return bound_; }
+
+    // Adds an existing ID to the filter
+    void add(std::int64_t id)
+    {
+        for_each_bit(id, [this](std::uint64_t bit) { words_[bit / 64] |= std::uint64_t(1) << (bit % 64); });
+    }
+
+    // Returns true if the ID is known not to exist in the database
+    bool definitely_missing(std::int64_t id) const
+    {
+        if (id > bound_)
+            return false;
+        bool all_set = true;
+        for_each_bit(id, [this, &all_set](std::uint64_t bit) {
+            all_set = all_set && (words_[bit / 64] & (std::uint64_t(1) << (bit % 64)));
+        });
+        return !all_set;
+    }
+};
+
+// A fast, non-cryptographic checksum, used to detect corrupted snapshot files.
+// Processes data in 64-bit words, padding the last one with zeros.
+// seed allows chaining several calls.
+inline std::uint64_t checksum(const void* data, std::size_t size, std::uint64_t seed)
+{
+    auto mix = [](std::uint64_t h, std::uint64_t word) {
+        h ^= word * 0x9e3779b97f4a7c15u;
+        h = std::rotl(h, 27) * 0xbf58476d1ce4e5b9u;
+        return h;
+    };
+
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    std::uint64_t h = seed;
+    std::size_t num_words = size / 8;
+    for (std::size_t i = 0; i < num_words; ++i)
+    {
+        std::uint64_t word;
+        std::memcpy(&word, bytes + i * 8, 8);
+        h = mix(h, word);
+    }
+    if (size % 8)
+    {
+        std::uint64_t word = 0;
+        std::memcpy(&word, bytes + num_words * 8, size % 8);
+        h = mix(h, word);
+    }
+    return mix(h, size);
+}
+
+// An in-memory copy of the correlations table, used in mirror mode.
+// Subjects are packed one after another in a contiguous arena, and located
+// through a dense array indexed by ID. This assumes that IDs are mostly contiguous,
+// which is the case for AUTO_INCREMENT columns. Lookups are a bounds check
+// and an array access. Immutable once built, so it can be shared between threads.
+// Rows deleted from the database are not removed from the mirror.
+//
+// Snapshots can be saved to a file and memory-mapped when the server restarts,
+// so it can serve requests right away. The file layout is a header,
+// followed by the index and the arena, exactly as they're laid out in memory.
+// Files are meant to be read by the machine that wrote them.
+class mirror_snapshot
+{
+public:
+    // Locates a subject in the arena
+    struct entry
+    {
+        std::uint64_t offset;
+        std::uint32_t size;
+        std::uint32_t reserved;
+    };
+    static_assert(sizeof(entry) == 16);
+
+    // Size of the entries for IDs that don't exist
+    static constexpr std::uint32_t absent = std::numeric_limits<std::uint32_t>::max();
+
+private:
+    // Starts every snapshot file. Also detects files written by machines with different endianness
+    static constexpr std::uint64_t file_magic = 0x50414e5352524f43;  // "CORRSNAP"
+
+    // Increment this when changing the file layout
+    static constexpr std::uint32_t file_version = 1;
+
+    struct file_header
+    {
+        std::uint64_t magic;
+        std::uint32_t version;
+        std::uint32_t entry_size;
+        std::uint64_t num_rows;
+        std::int64_t max_id;
+        std::int64_t max_updated_at;  // microseconds since the epoch
+        std::uint64_t index_size;     // number of entries
+        std::uint64_t arena_size;     // bytes
+        std::uint64_t checksum;       // of the index and the arena
+    };
+    static_assert(sizeof(file_header) % alignof(entry) == 0);
+
+    // Storage for snapshots built in memory
+    std::vector<entry> owned_index_;
+    std::string owned_arena_;
+
+    // Storage for snapshots loaded from a file
+    boost::interprocess::mapped_region region_;
+
+    // Point into one of the above
+    std::span<const entry> index_;
+    std::string_view arena_;
+
+    std::size_t num_rows_;
+    std::int64_t max_id_;
+    mysql::datetime::time_point max_updated_at_;
+
+    friend class mirror_builder;
+
+    static std::uint64_t compute_checksum(std::span<const entry> index, std::string_view arena)
+    {
+        std::uint64_t h = checksum(index.data(), index.size_bytes(), file_version);
+        return checksum(arena.data(), arena.size(), h);
+    }
+
+public:
+    mirror_snapshot(
+        std::vector<entry> index,
+        std::string arena,
+        std::size_t num_rows,
+        std::int64_t max_id,
+        mysql::datetime::time_point max_updated_at
+    )
+        : owned_index_(std::move(index)),
+          owned_arena_(std::move(arena)),
+          index_(owned_index_),
+          arena_(owned_arena_),
+          num_rows_(num_rows),
+          max_id_(max_id),
+          max_updated_at_(max_updated_at)
+    {
+    }
+
+    // index_ and arena_ point into the object itself
+    mirror_snapshot(const mirror_snapshot&) = delete;
+    mirror_snapshot& operator=(const mirror_snapshot&) = delete;
+
+    // Maps a snapshot file into memory. Throws if the file doesn't exist,
+    // or is not a valid snapshot file. Validating the file reads it entirely,
+    // so the pages are in memory by the time we start serving requests.
+    explicit mirror_snapshot(const std::string& path)
+    {
+        namespace ipc = boost::interprocess;
+
+        region_ = ipc::mapped_region(ipc::file_mapping(path.c_str(), ipc::read_only), ipc::read_only);
+        const auto* data = static_cast<const char*>(region_.get_address());
+        std::size_t size = region_.get_size();
+
+        // Validate the header
+        file_header header;
+        if (size < sizeof(header))
+            throw std::runtime_error("Snapshot file too small");
+        std::memcpy(&header, data, sizeof(header));
+        if (header.magic != file_magic || header.version != file_version ||
+            header.entry_size != sizeof(entry))
+            throw std::runtime_error("Unsupported snapshot file format");
+        std::size_t payload_size = size - sizeof(header);
+        if (header.index_size > payload_size / sizeof(entry) ||
+            header.arena_size > payload_size - header.index_size * sizeof(entry))
+            throw std::runtime_error("Snapshot file truncated");
+
+        index_ = {
+            reinterpret_cast<const entry*>(data + sizeof(header)),
+            static_cast<std::size_t>(header.index_size)
+        };
+        arena_ = {
+            data + sizeof(header) + index_.size_bytes(),
+            static_cast<std::size_t>(header.arena_size)
+        };
+        if (compute_checksum(index_, arena_) != header.checksum)
+            throw std::runtime_error("Snapshot file checksum mismatch");
+
+        // Lookups don't check offsets, so make sure they're valid
+        for (entry e : index_)
+        {
+            if (e.size != absent && (e.offset > arena_.size() || e.size > arena_.size() - e.offset))
+                throw std::runtime_error("Snapshot file contains invalid entries");
+        }
+
+        num_rows_ = static_cast<std::size_t>(header.num_rows);
+        max_id_ = header.max_id;
+        max_updated_at_ = mysql::datetime::time_point(std::chrono::microseconds(header.max_updated_at));
+    }
+
+    // Writes the snapshot to a file. The file is written under a temporary name and then renamed,
+    // so readers never see a partially written file.
+    // The file is not flushed to disk: if the machine crashes, the checksum will detect the damage.
+    void save(const std::string& path) const
+    {
+        file_header header{
+            .magic = file_magic,
+            .version = file_version,
+            .entry_size = sizeof(entry),
+            .num_rows = num_rows_,
+            .max_id = max_id_,
+            .max_updated_at = max_updated_at_.time_since_epoch().count(),
+            .index_size = index_.size(),
+            .arena_size = arena_.size(),
+            .checksum = compute_checksum(index_, arena_),
+        };
+
+        std::string tmp_path = path + ".tmp";
+        std::ofstream os(tmp_path, std::ios::binary | std::ios::trunc);
+        os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        os.write(reinterpret_cast<const char*>(index_.data()), index_.size_bytes());
+        os.write(arena_.data(), arena_.size());
+        os.close();
+        if (!os)
+            throw std::runtime_error("Error writing snapshot file " + tmp_path);
+        std::filesystem::rename(tmp_path, path);
+    }
+
+    // Retrieves the subject for the given ID, if it exists
+    std::optional<std::string_view> get(std::int64_t id) const
+    {
+        if (id < 0 || static_cast<std::uint64_t>(id) >= index_.size())
+            return {};
+        entry e = index_[static_cast<std::size_t>(id)];
+        if (e.size == absent)
+            return {};
+        return std::string_view(arena_.data() + e.offset, e.size);
+    }
+
+    std::size_t num_rows() const { return num_rows_; }
+
+    // The greatest ID and updated_at values in the mirror. Used to find rows changed since it was built
+    std::int64_t max_id() const { return max_id_; }
+    mysql::datetime::time_point max_updated_at() const { return max_updated_at_; }
+};
+
+// Thrown when the table's IDs are too sparse to index them by ID (e.g. after inserting
+// a row with a huge explicit ID). The server can't run in mirror mode then
+class mirror_too_sparse : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Builds a mirror_snapshot, either from scratch or applying changes to a previous one.
+// Replacing a subject leaves its old bytes in the arena. These are reclaimed
+// when building the snapshot, if they make up more than half of the arena.
+// The index has an entry per ID up to the greatest one, so it's only grown while it stays
+// reasonably dense. Rows should be added in ID order, so that the density is known.
+class mirror_builder
+{
+    // The index may have this many entries per row, or min_index_size entries, whatever is greater
+    static constexpr std::size_t max_entries_per_row = 4;
+    static constexpr std::size_t min_index_size = std::size_t(1) << 20;
+
+    // The snapshot the changes are applied to, until it's copied into index_ and arena_
+    std::shared_ptr<const mirror_snapshot> base_;
+
+    std::vector<mirror_snapshot::entry> index_;
+    std::string arena_;
+    std::size_t num_rows_{};
+    std::size_t live_bytes_{};
+    std::int64_t max_id_{};
+    mysql::datetime::time_point max_updated_at_{};
+    bool changed_{};
+
+    // Copies the base snapshot, so it can be modified
+    void materialize()
+    {
+        index_.assign(base_->index_.begin(), base_->index_.end());
+        arena_ = base_->arena_;
+        for (auto e : index_)
+        {
+            if (e.size != mirror_snapshot::absent)
+                live_bytes_ += e.size;
+        }
+        base_.reset();
+    }
+
+public:
+    mirror_builder() = default;
+
+    // Applies changes to base. Copying the snapshot is expensive, so it's only copied
+    // once a row actually changes: re-reading unchanged rows is cheap
+    explicit mirror_builder(std::shared_ptr<const mirror_snapshot> base)
+        : base_(std::move(base)),
+          num_rows_(base_->num_rows_),
+          max_id_(base_->max_id_),
+          max_updated_at_(base_->max_updated_at_)
+    {
+    }
+
+    // Adds a row, or replaces it if it already exists
+    void set(std::int64_t id, std::string_view subject, mysql::datetime::time_point updated_at)
+    {
+        // AUTO_INCREMENT IDs are always positive
+        if (id <= 0)
+            return;
+        if (subject.size() >= mirror_snapshot::absent)
+            throw std::length_error("mirror_builder::set: subject too long");
+
+        max_id_ = std::max(max_id_, id);
+        max_updated_at_ = std::max(max_updated_at_, updated_at);
+
+        // Re-reading unchanged rows is common, and shouldn't cause a new snapshot
+        if (base_)
+        {
+            if (base_->get(id) == subject)
+                return;
+            materialize();
+        }
+
+        auto idx = static_cast<std::size_t>(id);
+        if (idx >= index_.size())
+        {
+            if (idx >= std::max(min_index_size, max_entries_per_row * (num_rows_ + 1)))
+                throw mirror_too_sparse(
+                    "Table IDs are too sparse for mirror mode (found ID " + std::to_string(id) + ")"
+                );
+            index_.resize(idx + 1, {0u, mirror_snapshot::absent, 0u});
+        }
+
+        auto& e = index_[idx];
+        if (e.size == mirror_snapshot::absent)
+        {
+            ++num_rows_;
+        }
+        else
+        {
+            if (std::string_view(arena_.data() + e.offset, e.size) == subject)
+                return;
+            live_bytes_ -= e.size;
+        }
+
+        e = {arena_.size(), static_cast<std::uint32_t>(subject.size()), 0u};
+        arena_.append(subject);
+        live_bytes_ += subject.size();
+        changed_ = true;
+    }
+
+    // Whether any subject was added or replaced
+    bool changed() const { return changed_; }
+
+    std::shared_ptr<const mirror_snapshot> build() &&
+    {
+        if (base_)
+            return std::move(base_);
+
+        // Reclaim the space used by replaced subjects
+        if (live_bytes_ * 2 < arena_.size())
+        {
+            std::string compacted;
+            compacted.reserve(live_bytes_);
+            for (auto& e : index_)
+            {
+                if (e.size != mirror_snapshot::absent)
+                {
+                    std::size_t offset = compacted.size();
+                    compacted.append(arena_, e.offset, e.size);
+                    e.offset = offset;
+                }
+            }
+            arena_ = std::move(compacted);
+        }
+
+        return std::make_shared<const mirror_snapshot>(
+            std::move(index_),
+            std::move(arena_),
+            num_rows_,
+            max_id_,
+            max_updated_at_
+        );
+    }
+};
+
+// IDs whose cached responses should be refreshed in the background.
+// The cache makes sure that refreshes for an ID are only requested once in a while.
+// Not thread-safe: each worker has its own.
+class refresh_queue
+{
+    // Refreshes are dropped if the queue grows beyond this size.
+    // The cache will request them again later
+    static constexpr std::size_t max_size = 10000;
+
+    std::deque<std::int64_t> ids_;
+
+    // Waiters wait on this timer, which never expires.
+    // Cancelling it notifies them that there are new IDs
+    asio::steady_timer notify_;
+
+public:
+    explicit refresh_queue(asio::any_io_executor ex) : notify_(std::move(ex)) {}
+
+    // Requests a refresh for the given ID
+    void push(std::int64_t id)
+    {
+        if (ids_.size() < max_size)
+        {
+            ids_.push_back(id);
+            notify_.cancel();
+        }
+    }
+
+    // Waits until there are IDs to refresh, and removes up to max_ids of them
+    asio::awaitable<std::vector<std::int64_t>> pop(std::size_t max_ids)
+    {
+        while (ids_.empty())
+        {
+            notify_.expires_at(asio::steady_timer::time_point::max());
+            co_await notify_.async_wait(asio::as_tuple(asio::use_awaitable));
+        }
+
+        auto last = ids_.begin() + static_cast<std::ptrdiff_t>(std::min(max_ids, ids_.size()));
+        std::vector<std::int64_t> res(ids_.begin(), last);
+        ids_.erase(ids_.begin(), last);
+        co_return res;
+    }
+};
+
+// Detects sequential scans in a connection (requests for IDs n, n+1, n+2...),
+// and decides which IDs to prefetch, like an operating system's readahead.
+// Requests for n and n+1 start a scan. Once a scan is detected, a window of IDs ahead of the client
+// is prefetched, and the next window is requested when the client gets halfway through the current one.
+// Windows double every time, up to a maximum, and halve when a prefetched ID misses the cache.
+// This happens if IDs don't exist, or the cache doesn't admit prefetched entries,
+// so scans can't flush popular entries out of the cache.
+// Not thread-safe: each connection has its own.
+class readahead
+{
+    static constexpr std::int64_t min_window = 4;
+
+    std::int64_t max_window_;
+    std::int64_t window_{};
+    std::optional<std::int64_t> last_id_;
+
+    // The greatest IDs requested to be prefetched, and actually prefetched
+    std::int64_t prefetched_until_{};
+    std::int64_t completed_until_{};
+
+public:
+    // A range of IDs to prefetch, both ends included
+    struct range
+    {
+        std::int64_t first;
+        std::int64_t last;
+    };
+
+    // A max_window of zero disables prefetching
+    explicit readahead(std::int64_t max_window)
+        : max_window_(max_window == 0 ? 0 : std::max(max_window, min_window))
+    {
+    }
+
+    // Records a request for id, which hit the cache or not. Returns the IDs to prefetch, if any
+    std::optional<range> on_request(std::int64_t id, bool hit)
+    {
+        if (max_window_ == 0)
+            return {};
+
+        bool sequential = last_id_ && id == *last_id_ + 1;
+        last_id_ = id;
+        if (!sequential)
+        {
+            // The scan ended, or jumped somewhere else
+            prefetched_until_ = completed_until_ = 0;
+            window_ /= 2;
+            return {};
+        }
+
+        // A prediction missed
+        if (!hit && id <= completed_until_)
+            window_ /= 2;
+
+        // Keep at least half a window ahead of the client
+        if (prefetched_until_ - id > window_ / 2)
+            return {};
+
+        window_ = std::clamp(window_ * 2, min_window, max_window_);
+        range res{std::max(id, prefetched_until_) + 1, id + window_};
+        prefetched_until_ = res.last;
+        return res;
+    }
+
+    // Records that IDs up to last have been prefetched
+    void on_prefetched(std::int64_t last) { completed_until_ = std::max(completed_until_, last); }
+};
+
+// Counts requests per ID over a sliding window, to find the most requested IDs.
+// This is a count-min sketch with two generations of counters: requests are
+// recorded in the current one, and estimates add up both. Rotating the generations
+// every window discards counts older than two windows.
+// Shared by all workers. Requests are not recorded here directly, since incrementing
+// counters shared by all threads would make cache lines bounce between cores. Workers count them
+// in their own hot_key_counts, and merge them periodically. Counters are atomics updated
+// with relaxed ordering: counts are approximate anyway, so races with rotations are benign.
+class hot_key_sketch
+{
+    static constexpr std::size_t depth = 4;
+
+    std::size_t width_;
+    std::unique_ptr<std::atomic<std::uint32_t>[]> counters_;
+    std::atomic<unsigned> current_{0};
+
+    std::atomic<std::uint32_t>& counter(unsigned generation, std::uint64_t hash, std::size_t row) const
+    {
+        return counters_[(generation * depth + row) * width_ + sketch_index(hash, row, width_)];
+    }
+
+    // The count in the given row, adding up both generations
+    std::uint32_t row_count(std::uint64_t hash, std::size_t row) const
+    {
+        return counter(0, hash, row).load(std::memory_order_relaxed) +
+               counter(1, hash, row).load(std::memory_order_relaxed);
+    }
+
+    friend class hot_key_counts;
+
+public:
+    // width is the number of counters per row
+    explicit hot_key_sketch(std::size_t width)
+        : width_(std::bit_ceil(std::max<std::size_t>(width, 64))),
+          counters_(std::make_unique<std::atomic<std::uint32_t>[]>(2 * depth * width_))
+    {
+    }
+
+    // Estimates the number of requests for the given ID in the current and previous windows
+    std::uint32_t estimate(std::int64_t id) const
+    {
+        auto hash = hash_id(id);
+        std::uint32_t res = std::numeric_limits<std::uint32_t>::max();
+        for (std::size_t row = 0; row < depth; ++row)
+            res = std::min(res, row_count(hash, row));
+        return res;
+    }
+
+    // Starts a new window, discarding the oldest counts
+    void rotate()
+    {
+        unsigned oldest = current_.load(std::memory_order_relaxed) ^ 1u;
+        for (std::size_t i = 0; i < depth * width_; ++i)
+            counters_[oldest * depth * width_ + i].store(0, std::memory_order_relaxed);
+        current_.store(oldest, std::memory_order_relaxed);
+    }
+};
+
+// A worker's requests that haven't been merged into the hot_key_sketch yet.
+// Has the same layout as a generation of the sketch, so merging adds counters one by one.
+// Not thread-safe: each worker has its own.
+class hot_key_counts
+{
+    std::size_t width_;
+    std::vector<std::uint32_t> counters_;
+
+public:
+    explicit hot_key_counts(const hot_key_sketch& sketch)
+        : width_(sketch.width_), counters_(hot_key_sketch::depth * width_)
+    {
+    }
+
+    // Records a request for the given ID, and returns the estimated number of requests
+    // in the current and previous windows, including this one. Requests recorded
+    // by other workers count once they have been merged into sketch
+    std::uint32_t record(std::int64_t id, const hot_key_sketch& sketch)
+    {
+        auto hash = hash_id(id);
+        std::uint32_t res = std::numeric_limits<std::uint32_t>::max();
+        for (std::size_t row = 0; row < hot_key_sketch::depth; ++row)
+        {
+            std::uint32_t count = ++counters_[row * width_ + sketch_index(hash, row, width_)];
+            res = std::min(res, count + sketch.row_count(hash, row));
+        }
+        return res;
+    }
+
+    // Adds the counts to the sketch's current window, and resets them
+    void merge_into(hot_key_sketch& sketch)
+    {
+        unsigned current = sketch.current_.load(std::memory_order_relaxed);
+        auto* target = &sketch.counters_[current * hot_key_sketch::depth * width_];
+        for (std::size_t i = 0; i < counters_.size(); ++i)
+        {
+            if (counters_[i] != 0)
+            {
+                target[i].fetch_add(counters_[i], std::memory_order_relaxed);
+                counters_[i] = 0;
+            }
+        }
+    }
+};
+
+// An ID and its estimated number of recent requests
+struct hot_key
+{
+    std::int64_t id;
+    std::uint32_t requests;
+};
+
+// The most requested IDs seen by a worker (top-K), according to a hot_key_sketch.
+// Not thread-safe: each worker has its own.
+class hot_key_candidates
+{
+    std::size_t capacity_;
+    std::vector<hot_key> keys_;
+
+    // The lowest number of requests in keys_, once it's full
+    std::uint32_t min_requests_{};
+
+    void update_min()
+    {
+        min_requests_ = std::numeric_limits<std::uint32_t>::max();
+        for (const auto& k : keys_)
+            min_requests_ = std::min(min_requests_, k.requests);
+    }
+
+public:
+    explicit hot_key_candidates(std::size_t capacity) : capacity_(capacity) { keys_.reserve(capacity); }
+
+    // Considers an ID that has just been requested. Most IDs are not popular enough to be candidates,
+    // so the common case is a single comparison
+    void offer(std::int64_t id, std::uint32_t requests)
+    {
+        bool full = keys_.size() >= capacity_;
+        if (capacity_ == 0 || (full && requests <= min_requests_))
+            return;
+
+        auto it = std::find_if(keys_.begin(), keys_.end(), [id](const hot_key& k) { return k.id == id; });
+        if (it != keys_.end())
+            it->requests = requests;
+        else if (!full)
+            keys_.push_back({id, requests});
+        else
+            *std::min_element(keys_.begin(), keys_.end(), [](const hot_key& lhs, const hot_key& rhs) {
+                return lhs.requests < rhs.requests;
+            }) = {id, requests};
+
+        if (keys_.size() >= capacity_)
+            update_min();
+    }
+
+    // Updates the candidates' estimates, which decrease as windows rotate,
+    // and returns them, most requested first. IDs that are no longer requested are dropped
+    std::vector<hot_key> refresh(const hot_key_sketch& sketch)
+    {
+        for (auto& k : keys_)
+            k.requests = sketch.estimate(k.id);
+        std::erase_if(keys_, [](const hot_key& k) { return k.requests == 0; });
+        std::sort(keys_.begin(), keys_.end(), [](const hot_key& lhs, const hot_key& rhs) {
+            return lhs.requests > rhs.requests;
+        });
+        update_min();
+        return keys_;
+    }
+};
+
+// A worker's hot keys, published periodically so they can be read from any thread
+struct alignas(64) hot_key_list
+{
+    std::mutex mtx;
+    std::vector<hot_key> keys;
+};
+
+// State shared by all workers
+struct shared_state
+{
+    // Caches responses
+    response_cache cache;
+
+    // Metrics for each worker
+    std::vector<worker_metrics> metrics;
+
+    // Counts requests, to find the most requested IDs
+    hot_key_sketch hot_keys_sketch{std::size_t(1) << 14};
+
+    // The most requested IDs for each worker
+    std::vector<hot_key_list> hot_keys;
+
+    // The number of hot keys tracked by each worker
+    std::size_t num_hot_keys;
+
+    // The maximum number of IDs in a multi-ID lookup
+    std::size_t max_ids_per_lookup;
+
+    shared_state(const server_config& cfg)
+        : cache(cfg.cache_memory_budget, cfg.cache_ttl, cfg.cache_max_staleness),
+          metrics(cfg.num_threads),
+          hot_keys(cfg.num_threads),
+          num_hot_keys(cfg.num_hot_keys),
+          max_ids_per_lookup(cfg.max_ids_per_lookup)
+    {
+    }
+};
+
+// Everything a server thread needs to serve requests.
+// In thread-per-core mode, each thread owns a worker.
+// Apart from the cache, which is sharded, and metrics, which are per-worker,
+// workers don't share any state, so the data path never synchronizes with other threads.
+struct worker
+{
+    // Timeouts for the operations run by this thread. It's declared before ctx,
+    // so it outlives the handlers that ctx destroys when it's destroyed
+    timer_wheel timeouts{std::chrono::milliseconds(10)};
+
+    // The execution context for this thread. The concurrency hint
+    // tells Asio that a single thread will be calling run()
+    asio::io_context ctx{1};
+
+    // Contains connections to the database. Only this thread uses it,
+    // so it doesn't need to be thread-safe.
+    mysql::connection_pool pool;
+
+    // Connection checkouts made by requests, which take priority over background work
+    checkout_priority checkouts;
+
+    // Prepared statements for the connections in pool
+    statement_cache statements;
+
+    // Kills the queries of cancelled operations on connections in pool
+    query_killer killer;
+
+    // Coalesces concurrent lookups for the same correlation ID
+    singleflight<std::int64_t, std::shared_ptr<const serialized_response>> lookups;
+
+    // Groups lookups for different IDs into a single query
+    lookup_batcher batcher;
+
+    // Stale cache entries, to be refreshed by a background task
+    refresh_queue refreshes;
+
+    // State shared by all workers
+    shared_state& shared;
+
+    // This worker's counters
+    worker_metrics& metrics;
+
+    // The time budget for requests (see server_config::request_timeout).
+    // Stages of streamed responses that outlive the request's deadline get this long each
+    std::chrono::seconds request_timeout;
+
+    // The most requested IDs seen by this worker, and where they're published
+    hot_key_candidates hot_keys;
+    hot_key_list& published_hot_keys;
+
+    // Requests counted by this worker, periodically merged into the shared hot key sketch
+    hot_key_counts hot_key_requests;
+
+    // The IDs that exist in the database. Periodically refreshed by
+    // a background task, which replaces the pointer. May be null.
+    std::shared_ptr<const id_filter> ids;
+
+    // In mirror mode, a copy of the entire table. Periodically replaced
+    // by a background task. Null if not running in mirror mode.
+    std::shared_ptr<const mirror_snapshot> mirror;
+
+    worker(mysql::pool_params params, const server_config& cfg, shared_state& shared, std::size_t index)
+        : pool(ctx, params),
+          checkouts(pool, ctx.get_executor()),
+          killer(ctx.get_executor(), params, statements, timeouts, shared.metrics.at(index)),
+          batcher(checkouts, statements, killer, timeouts, cfg.max_batch_size, cfg.batch_window),
+          refreshes(ctx.get_executor()),
+          shared(shared),
+          metrics(shared.metrics.at(index)),
+          request_timeout(cfg.request_timeout),
+          hot_keys(cfg.num_hot_keys),
+          published_hot_keys(shared.hot_keys.at(index)),
+          hot_key_requests(shared.hot_keys_sketch)
+    {
+        timeouts.start(ctx.get_executor());
+    }
+
+    worker(const worker&) = delete;
+    worker& operator=(const worker&) = delete;
+
+    ~worker() { timeouts.stop(); }
+};
+
+// Helper function to log unhandled exceptions
+// when handling requests
+void log_exception(std::exception_ptr exc)
+{
+    try
+    {
+        std::rethrow_exception(exc);
+    }
+    catch (const std::exception& err)
+    {
+        std::cerr << "Unhandled exception: " << err.what() << std::endl;
+    }
+}
+
+// Validates an incoming HTTP request, extracting the correlation ID that the client
+// is asking for. If the verb or target don't match what we expect,
+// returns an empty optional.
+// A more refined version could return a std::expected/boost::system::result
+// containing what went wrong, so we can return specialized responses
+// (e.g. http::verb::method_not_allowed if the method is not what we expected).
+std::optional<std::int64_t> parse_request(const http::request<http::empty_body>& req)
+{
+    constexpr std::string_view prefix = "/";
+
+    // Check the verb
+    if (req.method() != http::verb::get)
+        return {};
+
+    // Check that the target starts with the prefix
+    auto target = req.target();
+    if (!target.starts_with(prefix))
+        return {};
+
+    // Attempt to parse the ID following the prefix
+    std::int64_t res{};
+    auto from_chars_res = std::from_chars(target.begin() + prefix.size(), target.end(), res);
+    if (from_chars_res.ec != std::errc{})
+        return {};
+    if (from_chars_res.ptr != target.end())
+        return {};
+
+    // Done
+    return res;
+}
+
+// Retrieves the value of a parameter from a query string, like "a=1&b=2".
+// Values are not percent-decoded
+std::optional<std::string_view> query_param(std::string_view query, std::string_view name)
+{
+    while (!query.empty())
+    {
+        auto amp_pos = query.find('&');
+        std::string_view param = query.substr(0, amp_pos);
+        query = amp_pos == std::string_view::npos ? std::string_view() : query.substr(amp_pos + 1);
+
+        auto eq_pos = param.find('=');
+        if (param.substr(0, eq_pos) == name)
+            return eq_pos == std::string_view::npos ? std::string_view() : param.substr(eq_pos + 1);
+    }
+    return {};
+}
+
+// Parses a comma-separated list of IDs, like "1,2,3". Returns an empty optional
+// if the list is malformed, or contains more than max_ids IDs. The limit is enforced
+// while parsing, so long lists are rejected without parsing them entirely.
+// With SSE2, characters are classified 16 at a time: validating a block
+// and locating its commas takes a handful of instructions. The digits between commas
+// are then folded into integers without further checks.
+std::optional<std::vector<std::int64_t>> parse_id_list(std::string_view input, std::size_t max_ids)
+{
+    // IDs with more digits may overflow
+    constexpr unsigned max_digits = 18;
+
+    std::vector<std::int64_t> res;
+    std::int64_t current = 0;
+    unsigned num_digits = 0;
+
+    // Adds a run of characters, known to be digits, to the current ID
+    auto fold_digits = [&](const char* first, const char* last) {
+        num_digits += static_cast<unsigned>(last - first);
+        if (num_digits > max_digits)
+            return false;
+        for (; first != last; ++first)
+            current = current * 10 + (*first - '0');
+        return true;
+    };
+
+    // Called when a comma is found
+    auto end_id = [&]() {
+        if (num_digits == 0 || res.size() >= max_ids)
+            return false;
+        res.push_back(current);
+        current = 0;
+        num_digits = 0;
+        return true;
+    };
+
+    const char* data = input.data();
+    std::size_t i = 0;
+#ifdef __SSE2__
+    const __m128i below_zero = _mm_set1_epi8('0' - 1);
+    const __m128i above_nine = _mm_set1_epi8('9' + 1);
+    const __m128i comma = _mm_set1_epi8(',');
+    for (; i + 16 <= input.size(); i += 16)
+    {
+        // Bytes above 0x7f compare as negative, so they're not digits
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i digits = _mm_and_si128(_mm_cmpgt_epi8(chunk, below_zero), _mm_cmplt_epi8(chunk, above_nine));
+        auto digit_mask = static_cast<unsigned>(_mm_movemask_epi8(digits));
+        auto comma_mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, comma)));
+        if ((digit_mask | comma_mask) != 0xffffu)
+            return {};
+
+        // Every comma ends an ID, so we can check the limit upfront
+        if (res.size() + static_cast<std::size_t>(std::popcount(comma_mask)) > max_ids)
+            return {};
+
+        const char* run_start = data + i;
+        for (; comma_mask != 0; comma_mask &= comma_mask - 1)
+        {
+            const char* comma_pos = data + i + std::countr_zero(comma_mask);
+            if (!fold_digits(run_start, comma_pos) || !end_id())
+                return {};
+            run_start = comma_pos + 1;
+        }
+        if (!fold_digits(run_start, data + i + 16))
+            return {};
+    }
+#endif
+
+    // Characters that don't fill a block
+    for (; i < input.size(); ++i)
+    {
+        char c = input[i];
+        if (c == ',')
+        {
+            if (!end_id())
+                return {};
+        }
+        else if (c >= '0' && c <= '9')
+        {
+            if (!fold_digits(data + i, data + i + 1))
+                return {};
+        }
+        else
+        {
+            return {};
+        }
+    }
+
+    // The last ID is not followed by a comma
+    if (!end_id())
+        return {};
+    return res;
+}
+
+// Appends a correlation as a {"id":1,"subject":"..."} JSON object
+void append_correlation(std::string& out, std::int64_t id, std::string_view subject)
+{
+    char id_buff[32];
+    auto id_end = std::to_chars(id_buff, id_buff + sizeof(id_buff), id).ptr;
+    out.append("{\"id\":");
+    out.append(id_buff, id_end);
+    out.append(",\"subject\":");
+    append_json_string(out, subject);
+    out.push_back('}');
+}
+
+// Formats correlations as a JSON array of {"id":1,"subject":"..."} objects,
+// or as newline-delimited JSON (one object per line).
+// Output can be produced in pieces, so it can be streamed.
+class correlation_writer
+{
+    bool ndjson_;
+    bool first_{true};
+
+public:
+    explicit correlation_writer(bool ndjson) : ndjson_(ndjson) {}
+
+    std::string_view content_type() const { return ndjson_ ? "application/x-ndjson" : "application/json"; }
+
+    void begin(std::string& out)
+    {
+        if (!ndjson_)
+            out.push_back('[');
+    }
+
+    void add(std::string& out, std::int64_t id, std::string_view subject)
+    {
+        if (!ndjson_ && !first_)
+            out.push_back(',');
+        first_ = false;
+        append_correlation(out, id, subject);
+        if (ndjson_)
+            out.push_back('\n');
+    }
+
+    void end(std::string& out)
+    {
+        if (!ndjson_)
+            out.push_back(']');
+    }
+};
+
+// Whether the client asked for newline-delimited JSON
+bool accepts_ndjson(const http::request<http::empty_body>& req)
+{
+    return req[http::field::accept].find("application/x-ndjson") != beast::string_view::npos;
+}
+
+// Whether the client asked for JSON
+bool accepts_json(const http::request<http::empty_body>& req)
+{
+    return req[http::field::accept].find("application/json") != beast::string_view::npos;
+}
+
+// Renders a single correlation as JSON, for clients that asked for it
+http::response<http::string_body> json_response(std::int64_t id, std::string_view subject)
+{
+    http::response<http::string_body> res;
+    res.set(http::field::content_type, "application/json");
+    res.body().reserve(subject.size() + 32);
+    append_correlation(res.body(), id, subject);
+    return res;
+}
+
+// Loads the subject for the given ID from the database, renders the response
+// and stores it in the cache. Returns null if the correlation doesn't exist.
+asio::awaitable<std::shared_ptr<const serialized_response>> load_response(
+    worker& w,
+    std::int64_t id,
+    std::chrono::steady_clock::time_point deadline
+)
+{
+    std::optional<std::string> subject = co_await w.batcher.load(id, deadline);
+    if (!subject)
+        co_return nullptr;
+    auto res = std::make_shared<const serialized_response>(http::status::ok, *subject);
+    w.shared.cache.put(id, res);
+    co_return res;
+}
+
+// A response whose body is produced while it's being written, for responses
+// that could be too big to hold in memory. The session writes the responses before it,
+// and then lets it write itself to the socket.
+class streamed_response
+{
+public:
+    virtual ~streamed_response() = default;
+
+    // Writes the response with the given HTTP version.
+    // The request's deadline applies until the headers have been written. After that,
+    // the body may take longer, as long as the client keeps reading it: each later stage
+    // (retrieving a piece of the body or writing it) gets a budget of its own (see worker::request_timeout).
+    // Returns whether the connection can be kept alive afterwards
+    virtual asio::awaitable<bool> write(
+        asio::ip::tcp::socket& sock,
+        unsigned version,
+        bool keep_alive,
+        std::chrono::steady_clock::time_point deadline
+    ) = 0;
+};
+
+// Writes a response body in pieces, using chunked transfer encoding.
+// HTTP/1.0 clients don't support it, so bodies are written as they are,
+// and the connection is closed to signal their end.
+class chunked_writer
+{
+    asio::ip::tcp::socket& sock_;
+    timer_wheel& timeouts_;
+    std::chrono::steady_clock::duration write_timeout_;
+    unsigned version_;
+    bool keep_alive_{};
+
+public:
+    // The headers are written before the request's deadline,
+    // and each piece of the body within write_timeout
+    chunked_writer(
+        asio::ip::tcp::socket& sock,
+        timer_wheel& timeouts,
+        std::chrono::steady_clock::duration write_timeout,
+        unsigned version
+    )
+        : sock_(sock), timeouts_(timeouts), write_timeout_(write_timeout), version_(version)
+    {
+    }
+
+    // Whether the connection can be kept alive after the response
+    bool keep_alive() const { return keep_alive_; }
+
+    asio::awaitable<void> write_header(
+        http::response<http::empty_body>& res,
+        bool keep_alive,
+        std::chrono::steady_clock::time_point deadline
+    )
+    {
+        keep_alive_ = version_ != 10 && keep_alive;
+        res.version(version_);
+        res.keep_alive(keep_alive_);
+        if (version_ != 10)
+            res.chunked(true);
+        http::response_serializer<http::empty_body> sr(res);
+        co_await http::async_write_header(sock_, sr, wheel_cancel_at(timeouts_, deadline));
+    }
+
+    asio::awaitable<void> write_chunk(std::string_view data)
+    {
+        // An empty chunk would end the body
+        if (data.empty())
+            co_return;
+        if (version_ != 10)
+        {
+            co_await asio::async_write(
+                sock_,
+                http::make_chunk(asio::buffer(data)),
+                wheel_cancel_after(timeouts_, write_timeout_)
+            );
+        }
+        else
+        {
+            co_await asio::async_write(
+                sock_,
+                asio::buffer(data),
+                wheel_cancel_after(timeouts_, write_timeout_)
+            );
+        }
+    }
+
+    asio::awaitable<void> finish()
+    {
+        if (version_ != 10)
+        {
+            co_await asio::async_write(
+                sock_,
+                http::make_chunk_last(),
+                wheel_cancel_after(timeouts_, write_timeout_)
+            );
+        }
+    }
+};
+
+// A response to be written to the client. Most responses are built as Beast messages,
+// but responses for cached correlations are pre-serialized, and big responses are streamed
+using response = std::variant<
+    http::response<http::string_body>,
+    std::shared_ptr<const serialized_response>,
+    std::shared_ptr<streamed_response>>;
+
+// Composes a plaintext response with the server's counters
+http::response<http::string_body> metrics_response(const shared_state& shared)
+{
+    http::response<http::string_body> res;
+    res.set(http::field::content_type, "text/plain");
+
+    auto add_metric = [&res](std::string_view name, std::uint64_t value) {
+        res.body().append(name);
+        res.body().push_back(' ');
+        res.body().append(std::to_string(value));
+        res.body().push_back('\n');
+    };
+
+    auto cache_stats = shared.cache.get_stats();
+    add_metric("cache_hits", cache_stats.hits);
+    add_metric("cache_stale_hits", cache_stats.stale_hits);
+    add_metric("cache_misses", cache_stats.misses);
+    add_metric("cache_admissions", cache_stats.admissions);
+    add_metric("cache_rejections", cache_stats.rejections);
+    add_metric("cache_evictions", cache_stats.evictions);
+
+    // Per-worker metrics are added up
+    auto sum = [&shared](std::atomic<std::uint64_t> worker_metrics::*counter) {
+        std::uint64_t res = 0;
+        for (const auto& m : shared.metrics)
+            res += (m.*counter).load(std::memory_order_relaxed);
+        return res;
+    };
+    add_metric("filtered_lookups", sum(&worker_metrics::filtered_lookups));
+    add_metric("background_refreshes", sum(&worker_metrics::background_refreshes));
+    add_metric("hot_key_prefetches", sum(&worker_metrics::hot_key_prefetches));
+    add_metric("readahead_queries", sum(&worker_metrics::readahead_queries));
+    add_metric("readahead_rows", sum(&worker_metrics::readahead_rows));
+    add_metric("readahead_skipped", sum(&worker_metrics::readahead_skipped));
+    add_metric("binary_requests", sum(&worker_metrics::binary_requests));
+    add_metric("abandoned_requests", sum(&worker_metrics::abandoned_requests));
+    add_metric("interrupted_queries", sum(&worker_metrics::interrupted_queries));
+    add_metric("queries_killed", sum(&worker_metrics::queries_killed));
+    add_metric("query_kill_failures", sum(&worker_metrics::query_kill_failures));
+    add_metric("connections_recovered", sum(&worker_metrics::connections_recovered));
+    add_metric("connections_reconnected", sum(&worker_metrics::connections_reconnected));
+
+    return res;
+}
+
+// Loads a range of IDs into the cache, anticipating the requests of a sequential scan.
+// The query is not a prepared statement, so the time left until the deadline can be passed
+// as an optimizer hint. Parsing it is cheap compared to the rows it reads.
+// Prefetches are speculative, so they're skipped while requests are waiting for a connection:
+// by the time one got it, the client would likely have requested the IDs already
+asio::awaitable<void> prefetch_range(
+    worker& w,
+    readahead::range ids,
+    std::weak_ptr<readahead> ra,
+    std::chrono::steady_clock::time_point deadline
+)
+{
+    if (w.checkouts.busy())
+    {
+        w.metrics.readahead_skipped.fetch_add(1, std::memory_order_relaxed);
+        co_return;
+    }
+
+    mysql::pooled_connection conn = co_await w.pool.async_get_connection();
+    query_watch watch(w.killer, w.timeouts, conn, deadline);
+    mysql::results result;
+    try
+    {
+        co_await conn->async_execute(
+            mysql::with_params(
+                "SELECT /*+ MAX_EXECUTION_TIME({}) */ id, subject FROM correlations "
+                "WHERE id BETWEEN {} AND {}",
+                execution_budget(deadline),
+                ids.first,
+                ids.last
+            ),
+            result
+        );
+    }
+    catch (...)
+    {
+        // The connection will be reset, deallocating its statements
+        w.statements.invalidate(conn.get());
+        watch.release_after_error(std::current_exception());
+        throw;
+    }
+    watch.release();
+
+    for (auto row : result.rows())
+    {
+        auto res = std::make_shared<const serialized_response>(http::status::ok, row.at(1).as_string());
+        w.shared.cache.put(row.at(0).as_int64(), std::move(res));
+    }
+    w.metrics.readahead_queries.fetch_add(1, std::memory_order_relaxed);
+    w.metrics.readahead_rows.fetch_add(result.rows().size(), std::memory_order_relaxed);
+
+    // The connection may have been closed by now
+    if (auto ptr = ra.lock())
+        ptr->on_prefetched(ids.last);
+}
+
+// Composes a plaintext response with the most requested IDs, one per line,
+// with the estimated number of requests in the last windows.
+// Merges the lists published by all workers
+http::response<http::string_body> hot_keys_response(shared_state& shared)
+{
+    std::unordered_map<std::int64_t, std::uint32_t> merged;
+    for (auto& list : shared.hot_keys)
+    {
+        std::lock_guard<std::mutex> guard(list.mtx);
+        for (const auto& k : list.keys)
+        {
+            auto& requests = merged[k.id];
+            requests = std::max(requests, k.requests);
+        }
+    }
+
+    std::vector<hot_key> keys;
+    for (auto [id, requests] : merged)
+        keys.push_back({id, requests});
+    std::sort(keys.begin(), keys.end(), [](const hot_key& lhs, const hot_key& rhs) {
+        return lhs.requests > rhs.requests;
+    });
+    if (keys.size() > shared.num_hot_keys)
+        keys.resize(shared.num_hot_keys);
+
+    http::response<http::string_body> res;
+    res.set(http::field::content_type, "text/plain");
+    for (const auto& k : keys)
+    {
+        res.body().append(std::to_string(k.id));
+        res.body().push_back(' ');
+        res.body().append(std::to_string(k.requests));
+        res.body().push_back('\n');
+    }
+    return res;
+}
+
+// Handles GET /correlations?ids=1,2,3. Returns the subjects for the given IDs
+// as a JSON array of {"id":1,"subject":"..."} objects, or as newline-delimited JSON
+// if the client accepts application/x-ndjson. Duplicate IDs are returned once,
+// and IDs that don't exist are omitted. Cache hits are resolved locally,
+// and misses are looked up with a single query.
+asio::awaitable<http::response<http::string_body>> handle_batch_lookup(
+    worker& w,
+    const http::request<http::empty_body>& req,
+    std::string_view ids_param,
+    query_watch_list& queries,
+    std::chrono::steady_clock::time_point deadline
+)
+{
+    http::response<http::string_body> res;
+
+    auto ids = parse_id_list(ids_param, w.shared.max_ids_per_lookup);
+    if (!ids)
+    {
+        res.result(http::status::bad_request);
+        co_return res;
+    }
+
+    // Remove duplicates, keeping the first occurrence of each ID
+    std::unordered_set<std::int64_t> seen;
+    seen.reserve(ids->size());
+    std::erase_if(*ids, [&seen](std::int64_t id) { return !seen.insert(id).second; });
+
+    // The subject for each ID, if found. Subjects point into these objects,
+    // which must be kept alive until the body is composed
+    std::vector<std::optional<std::string_view>> subjects(ids->size());
+    std::shared_ptr<const mirror_snapshot> mirror = w.mirror;
+    std::vector<std::shared_ptr<const serialized_response>> responses;
+    std::unordered_map<std::int64_t, std::string> loaded;
+
+    if (mirror)
+    {
+        // In mirror mode, the entire table is in memory
+        for (std::size_t i = 0; i < ids->size(); ++i)
+            subjects[i] = mirror->get((*ids)[i]);
+    }
+    else
+    {
+        // Try the cache, collecting the misses
+        std::vector<std::int64_t> misses;
+        for (std::size_t i = 0; i < ids->size(); ++i)
+        {
+            std::int64_t id = (*ids)[i];
+            if (w.ids && w.ids->definitely_missing(id))
+            {
+                w.metrics.filtered_lookups.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            if (w.shared.num_hot_keys != 0)
+                w.hot_keys.offer(id, w.hot_key_requests.record(id, w.shared.hot_keys_sketch));
+
+            auto lookup = w.shared.cache.get(id);
+            if (lookup.needs_refresh)
+                w.refreshes.push(id);
+            if (lookup.response)
+            {
+                subjects[i] = lookup.response->body();
+                responses.push_back(std::move(lookup.response));
+            }
+            else
+            {
+                misses.push_back(id);
+            }
+        }
+
+        // Look up the misses with a single query, and cache them
+        if (!misses.empty())
+        {
+            mysql::pooled_connection conn = co_await w.checkouts.get_connection(
+                wheel_cancel_at(w.timeouts, deadline)
+            );
+            query_watch watch(w.killer, w.timeouts, conn, deadline, &queries);
+            try
+            {
+                loaded = co_await query_subjects(conn.get(), w.statements, misses, deadline);
+            }
+            catch (...)
+            {
+                watch.release_after_error(std::current_exception());
+                throw;
+            }
+            watch.release();
+
+            for (const auto& [id, subject] : loaded)
+            {
+                auto cached = std::make_shared<const serialized_response>(http::status::ok, subject);
+                w.shared.cache.put(id, std::move(cached));
+            }
+            for (std::size_t i = 0; i < ids->size(); ++i)
+            {
+                if (subjects[i])
+                    continue;
+                auto it = loaded.find((*ids)[i]);
+                if (it != loaded.end())
+                    subjects[i] = it->second;
+            }
+        }
+    }
+
+    // Compose the body
+    correlation_writer writer(accepts_ndjson(req));
+    writer.begin(res.body());
+    for (std::size_t i = 0; i < ids->size(); ++i)
+    {
+        if (subjects[i])
+            writer.add(res.body(), (*ids)[i], *subjects[i]);
+    }
+    writer.end(res.body());
+    res.set(http::field::content_type, writer.content_type());
+    co_return res;
+}
+
+// Retrieves up to a number of correlations with IDs greater than a given one, in ascending order.
+// Takes the time budget (see execution_budget), the ID and the number of rows.
+// Scans can run for long, so this is not a prepared statement: its text includes the budget
+constexpr std::string_view range_query =
+    "SELECT /*+ MAX_EXECUTION_TIME({}) */ id, subject FROM correlations WHERE id > {} ORDER BY id LIMIT {}";
+
+// The number of rows retrieved per query by streamed responses
+constexpr std::int64_t range_batch_size = 1000;
+
+// Retrieves up to limit correlations with IDs greater than last_id before the deadline,
+// formatting them into chunk, and updates last_id to the last ID retrieved. Returns the number of rows.
+// Streamed responses read rows in batches (keyset pagination), checking out a connection per batch,
+// so connections are not held while writing to slow clients
+asio::awaitable<std::int64_t> read_range_batch(
+    worker& w,
+    correlation_writer& writer,
+    std::string& chunk,
+    std::int64_t& last_id,
+    std::int64_t limit,
+    std::chrono::steady_clock::time_point deadline
+)
+{
+    mysql::pooled_connection conn = co_await w.checkouts.get_connection(
+        wheel_cancel_at(w.timeouts, deadline)
+    );
+    query_watch watch(w.killer, w.timeouts, conn, deadline);
+    try
+    {
+        mysql::execution_state st;
+        co_await conn->async_start_execution(
+            mysql::with_params(range_query, execution_budget(deadline), last_id, limit),
+            st,
+            wheel_cancel_at(w.timeouts, deadline)
+        );
+        std::int64_t num_rows = 0;
+        while (!st.complete())
+        {
+            mysql::rows_view rows = co_await conn->async_read_some_rows(
+                st,
+                wheel_cancel_at(w.timeouts, deadline)
+            );
+            for (auto row : rows)
+            {
+                last_id = row.at(0).as_int64();
+                writer.add(chunk, last_id, row.at(1).as_string());
+            }
+            num_rows += static_cast<std::int64_t>(rows.size());
+        }
+        watch.release();
+        co_return num_rows;
+    }
+    catch (...)
+    {
+        // The connection will be reset, deallocating its statements
+        w.statements.invalidate(conn.get());
+        watch.release_after_error(std::current_exception());
+        throw;
+    }
+}
+
+// Writes a 500 response for streamed responses that failed before writing their headers.
+// Returns whether the connection can be kept alive
+asio::awaitable<bool> write_internal_error(
+    asio::ip::tcp::socket& sock,
+    timer_wheel& timeouts,
+    unsigned version,
+    bool keep_alive,
+    std::chrono::steady_clock::time_point deadline
+)
+{
+    http::response<http::string_body> res{http::status::internal_server_error, version};
+    res.keep_alive(keep_alive);
+    res.prepare_payload();
+    co_await http::async_write(sock, res, wheel_cancel_at(timeouts, deadline));
+    co_return res.keep_alive();
+}
+
+// Handles GET /correlations?after=<id>&limit=<n>. Streams the correlations
+// with IDs greater than after, in ascending order, up to limit rows (keyset pagination:
+// clients pass the last ID they got to retrieve the next page).
+// Like export_response, rows are retrieved and written in batches, so memory usage is bounded
+// by the batch size, and connections are only checked out while retrieving a batch.
+// Pages with more rows than a batch are not a consistent snapshot.
+class range_response final : public streamed_response
+{
+    worker& w_;
+    correlation_writer writer_;
+    std::int64_t last_id_;
+    std::int64_t remaining_;
+
+    // Retrieves the next batch of rows, appending them to chunk, before the deadline.
+    // Returns whether there may be more rows
+    asio::awaitable<bool> read_batch(std::string& chunk, std::chrono::steady_clock::time_point deadline)
+    {
+        std::int64_t limit = std::min(range_batch_size, remaining_);
+        std::int64_t num_rows = co_await read_range_batch(w_, writer_, chunk, last_id_, limit, deadline);
+        remaining_ -= num_rows;
+        co_return num_rows == limit && remaining_ != 0;
+    }
+
+public:
+    // The maximum number of rows per page
+    static constexpr std::int64_t max_limit = 100000;
+
+    range_response(worker& w, std::int64_t after, std::int64_t limit, bool ndjson)
+        : w_(w), writer_(ndjson), last_id_(after), remaining_(limit)
+    {
+    }
+
+    asio::awaitable<bool> write(
+        asio::ip::tcp::socket& sock,
+        unsigned version,
+        bool keep_alive,
+        std::chrono::steady_clock::time_point deadline
+    ) override
+    {
+        // Retrieve the first batch before writing the headers, so errors can still be reported
+        // with a status code (co_await is not allowed in catch blocks, so the error response
+        // is written after them)
+        std::string chunk;
+        writer_.begin(chunk);
+        bool more = false, failed = false;
+        try
+        {
+            more = co_await read_batch(chunk, deadline);
+        }
+        catch (const std::exception& err)
+        {
+            std::cerr << "Error while handling request: " << err.what() << std::endl;
+            failed = true;
+        }
+        if (failed)
+            co_return co_await write_internal_error(sock, w_.timeouts, version, keep_alive, deadline);
+
+        // Once the headers are written, errors can only be signaled by closing the connection
+        chunked_writer out(sock, w_.timeouts, w_.request_timeout, version);
+        http::response<http::empty_body> res{http::status::ok, version};
+        res.set(http::field::content_type, writer_.content_type());
+        co_await out.write_header(res, keep_alive, deadline);
+        while (true)
+        {
+            if (!more)
+                writer_.end(chunk);
+            co_await out.write_chunk(chunk);
+            chunk.clear();
+            if (!more)
+                break;
+            // Later batches are not bound by the request's deadline, but by their own
+            more = co_await read_batch(chunk, std::chrono::steady_clock::now() + w_.request_timeout);
+        }
+        co_await out.finish();
+        co_return out.keep_alive();
+    }
+};
+
+// Handles GET /export. Streams the entire table as newline-delimited JSON, in ID order.
+// Rows are retrieved in batches, using keyset pagination, and each batch is formatted
+// into a reused buffer. The next batch is only retrieved once the previous one has been
+// written to the socket, so a slow client slows down the export instead of making us
+// buffer rows, and memory usage is bounded by the batch size.
+// Connections are only checked out while retrieving a batch, rather than for the entire export.
+// The export is not a consistent snapshot: rows changed while it runs may or may not be reflected.
+class export_response final : public streamed_response
+{
+    worker& w_;
+    correlation_writer writer_{true};
+    std::int64_t last_id_{0};
+
+    // Retrieves the next batch of rows, appending them to chunk, before the deadline.
+    // Returns whether there may be more rows
+    asio::awaitable<bool> read_batch(std::string& chunk, std::chrono::steady_clock::time_point deadline)
+    {
+        co_return co_await read_range_batch(w_, writer_, chunk, last_id_, range_batch_size, deadline) ==
+                  range_batch_size;
+    }
+
+public:
+    explicit export_response(worker& w) : w_(w) {}
+
+    asio::awaitable<bool> write(
+        asio::ip::tcp::socket& sock,
+        unsigned version,
+        bool keep_alive,
+        std::chrono::steady_clock::time_point deadline
+    ) override
+    {
+        // Retrieve the first batch before writing the headers,
+        // so errors can still be reported with a status code
+        std::string chunk;
+        bool more = false, failed = false;
+        try
+        {
+            more = co_await read_batch(chunk, deadline);
+        }
+        catch (const std::exception& err)
+        {
+            std::cerr << "Error while handling request: " << err.what() << std::endl;
+            failed = true;
+        }
+        if (failed)
+            co_return co_await write_internal_error(sock, w_.timeouts, version, keep_alive, deadline);
+
+        // Once the headers are written, errors can only be signaled by closing the connection
+        chunked_writer out(sock, w_.timeouts, w_.request_timeout, version);
+        http::response<http::empty_body> res{http::status::ok, version};
+        res.set(http::field::content_type, writer_.content_type());
+        co_await out.write_header(res, keep_alive, deadline);
+        while (true)
+        {
+            co_await out.write_chunk(chunk);
+            chunk.clear();
+            if (!more)
+                break;
+            // Later batches are not bound by the request's deadline, but by their own
+            more = co_await read_batch(chunk, std::chrono::steady_clock::now() + w_.request_timeout);
+        }
+        co_await out.finish();
+        co_return out.keep_alive();
+    }
+};
+
+// Looks up the response for the given ID, using the ID filter, the cache and the database.
+// Returns null if the correlation doesn't exist. Used by both HTTP and binary protocol sessions
+asio::awaitable<std::shared_ptr<const serialized_response>> lookup_response(
+    worker& w,
+    std::int64_t id,
+    const std::shared_ptr<readahead>& ra,
+    std::chrono::steady_clock::time_point deadline
+)
+{
+    // If the ID is known not to exist, we don't need to query the database
+    if (w.ids && w.ids->definitely_missing(id))
+    {
+        w.metrics.filtered_lookups.fetch_add(1, std::memory_order_relaxed);
+        co_return nullptr;
+    }
+
+    // Track the most requested IDs, so their cache entries are kept fresh
+    if (w.shared.num_hot_keys != 0)
+        w.hot_keys.offer(id, w.hot_key_requests.record(id, w.shared.hot_keys_sketch));
+
+    // Try the cache. Cached responses are written as they are, without copying them.
+    // Stale responses are served while they're refreshed in the background
+    auto lookup = w.shared.cache.get(id);
+    std::shared_ptr<const serialized_response> cached = std::move(lookup.response);
+    if (lookup.needs_refresh)
+        w.refreshes.push(id);
+
+    // If the client is scanning IDs sequentially, prefetch the next ones.
+    // The prefetch is shared by the following requests, so it's not
+    // a child of this one. It has its own timeout, instead
+    if (auto ids = ra->on_request(id, cached != nullptr))
+    {
+        auto prefetch_deadline = std::chrono::steady_clock::now() + background_timeout;
+        asio::co_spawn(
+            co_await asio::this_coro::executor,
+            prefetch_range(w, *ids, ra, prefetch_deadline),
+            wheel_cancel_at(w.timeouts, prefetch_deadline, asio::detached)
+        );
+    }
+
+    // On a miss, look up the correlation in the database.
+    // If other requests are already looking up the same ID,
+    // this waits for their result instead of querying the database again.
+    // Lookups for different IDs are batched into a single query.
+    // We pass a regular lambda (not a coroutine) returning an awaitable,
+    // so the lookup doesn't depend on the lambda's captures.
+    // Requests joining a lookup in progress get the deadline of the one that started it
+    if (!cached)
+        cached = co_await w.lookups.get(id, [&w, id, deadline] { return load_response(w, id, deadline); });
+    co_return cached;
+}
+
+// Handles an individual HTTP request.
+// This function accesses the SQL database, performing async operations,
+// so it's a C++20 coroutine. Coroutines in Asio return asio::awaitable<T>,
+// where T is the type to co_return from the coroutine.
+// We will set a timeout to the entire coroutine (see the call site).
+asio::awaitable<response> handle_request(
+    worker& w,                                      // contains connections to the database
+    const http::request<http::empty_body>& req,     // HTTP request
+    const std::shared_ptr<readahead>& ra,           // the connection's sequential access detector
+    query_watch_list& queries,                      // the connection's queries, killed if the client leaves
+    std::chrono::steady_clock::time_point deadline  // when the response should be written by
+)
+{
+    // The response to return
+    http::response<http::string_body> res;
+
+    try
+    {
+        // Administrative endpoints
+        if (req.method() == http::verb::get && req.target() == "/admin/metrics")
+            co_return metrics_response(w.shared);
+        if (req.method() == http::verb::get && req.target() == "/admin/hot-keys")
+            co_return hot_keys_response(w.shared);
+
+        // Full-table exports
+        if (req.method() == http::verb::get && req.target() == "/export")
+            co_return std::make_shared<export_response>(w);
+
+        // Multi-ID lookups
+        constexpr std::string_view correlations_prefix = "/correlations?";
+        if (req.method() == http::verb::get && req.target().starts_with(correlations_prefix))
+        {
+            std::string_view query = req.target().substr(correlations_prefix.size());
+            if (auto ids_param = query_param(query, "ids"))
+                co_return co_await handle_batch_lookup(w, req, *ids_param, queries, deadline);
+
+            // Range listings. Either parameter may be omitted
+            std::int64_t after = 0, limit = 100;
+            bool is_range = query_param(query, "after") || query_param(query, "limit");
+            auto parse_param = [query](std::string_view name, std::int64_t& to) {
+                auto value = query_param(query, name);
+                if (!value)
+                    return true;
+                auto [ptr, ec] = std::from_chars(value->data(), value->data() + value->size(), to);
+                return ec == std::errc{} && ptr == value->data() + value->size();
+            };
+            if (is_range && parse_param("after", after) && parse_param("limit", limit) && limit > 0 &&
+                limit <= range_response::max_limit)
+                co_return std::make_shared<range_response>(w, after, limit, accepts_ndjson(req));
+
+            res.result(http::status::bad_request);
+            co_return res;
+        }
+
+        // Parse the request
+        std::optional<std::int64_t> id = parse_request(req);
+        if (!id)
+        {
+            res.result(http::status::bad_request);  // HTTP 400
+            co_return res;
+        }
+
+        // In mirror mode, the entire table is in memory
+        if (w.mirror)
+        {
+            std::optional<std::string_view> subject = w.mirror->get(*id);
+            if (!subject)
+            {
+                res.result(http::status::not_found);
+                co_return res;
+            }
+            if (accepts_json(req))
+                co_return json_response(*id, *subject);
+            res.body() = *subject;
+            co_return res;
+        }
+
+        // Look up the correlation
+        std::shared_ptr<const serialized_response> cached = co_await lookup_response(w, *id, ra, deadline);
+
+        // If the correlation doesn't exist, return a 404
+        if (!cached)
+        {
+            res.result(http::status::not_found);
+            co_return res;
+        }
+
+        // Return the response. Cached responses hold the subject as plain text.
+        // JSON is rendered from them on demand, rather than caching both formats
+        if (accepts_json(req))
+            co_return json_response(*id, cached->body());
+        co_return cached;
+    }
+    catch (const std::exception& err)
+    {
+        // If any of the above operations encountered an error,
+        // an exception is thrown. This can happen if the server
+        // is unhealthy, the server returns an error when running the query,
+        // or the coroutine gets cancelled.
+        std::cerr << "Error while handling request: " << err.what() << std::endl;
+        res.result(http::status::internal_server_error);  // 500 error
+        co_return res;
+    }
+}
+
+// Reloads the cached responses for the given IDs from the database.
+// Responses for IDs that no longer exist are removed from the cache.
+asio::awaitable<void> refresh_responses(
+    worker& w,
+    std::span<const std::int64_t> ids,
+    std::chrono::steady_clock::time_point deadline
+)
+{
+    mysql::pooled_connection conn = co_await w.pool.async_get_connection();
+    query_watch watch(w.killer, w.timeouts, conn, deadline);
+    std::unordered_map<std::int64_t, std::string> subjects;
+    try
+    {
+        subjects = co_await query_subjects(conn.get(), w.statements, ids, deadline);
+    }
+    catch (...)
+    {
+        watch.release_after_error(std::current_exception());
+        throw;
+    }
+    watch.release();
+
+    for (std::int64_t id : ids)
+    {
+        auto it = subjects.find(id);
+        if (it == subjects.end())
+            w.shared.cache.erase(id);
+        else
+            w.shared.cache.put(id, std::make_shared<const serialized_response>(http::status::ok, it->second));
+    }
+}
+
+// Refreshes stale cache entries in the background, in batches.
+// Refreshes have a lower priority than requests:
+// they don't check out connections while requests are waiting for one.
+// If the pool is saturated for long, entries expire and are looked up by requests again.
+asio::awaitable<void> run_cache_refresher(worker& w, std::size_t max_batch_size)
+{
+    auto ex = co_await asio::this_coro::executor;
+
+    while (true)
+    {
+        std::vector<std::int64_t> ids = co_await w.refreshes.pop(max_batch_size);
+
+        // Let requests go first
+        co_await w.checkouts.wait_idle();
+
+        try
+        {
+            auto deadline = std::chrono::steady_clock::now() + background_timeout;
+            co_await asio::co_spawn(
+                ex,
+                refresh_responses(w, ids, deadline),
+                wheel_cancel_at(w.timeouts, deadline)
+            );
+            w.metrics.background_refreshes.fetch_add(ids.size(), std::memory_order_relaxed);
+        }
+        catch (const std::exception& err)
+        {
+            // Entries are still served, and refreshes will be requested again
+            std::cerr << "Error refreshing cached responses: " << err.what() << std::endl;
+        }
+    }
+}
+
+// Keeps the most requested IDs in the cache. Periodically publishes this worker's
+// hot keys, and requests background refreshes for their cache entries
+// before they become stale, so requests for them never miss the cache.
+// Merges the requests counted by this worker into the shared sketch first.
+// One of the workers also rotates the sketch's windows.
+asio::awaitable<void> run_hot_key_prefetcher(worker& w, bool rotate_windows, std::chrono::seconds window)
+{
+    using namespace std::chrono_literals;
+    constexpr auto interval = 1s;
+
+    asio::steady_timer timer(co_await asio::this_coro::executor);
+    auto next_rotation = std::chrono::steady_clock::now() + window;
+
+    while (true)
+    {
+        timer.expires_after(interval);
+        co_await timer.async_wait();
+
+        w.hot_key_requests.merge_into(w.shared.hot_keys_sketch);
+        if (rotate_windows && std::chrono::steady_clock::now() >= next_rotation)
+        {
+            w.shared.hot_keys_sketch.rotate();
+            next_rotation += window;
+        }
+
+        std::vector<hot_key> keys = w.hot_keys.refresh(w.shared.hot_keys_sketch);
+        {
+            std::lock_guard<std::mutex> guard(w.published_hot_keys.mtx);
+            w.published_hot_keys.keys = keys;
+        }
+
+        // Refreshes are processed by the cache refresher.
+        // Entries must be refreshed before the next check
+        for (const auto& k : keys)
+        {
+            if (w.shared.cache.claim_refresh(k.id, 2 * interval))
+            {
+                w.refreshes.push(k.id);
+                w.metrics.hot_key_prefetches.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+// The outcome of building an id_filter
+struct id_filter_build
+{
+    std::shared_ptr<const id_filter> filter;
+
+    // Whether the snapshot contains rows below the previous filter's bound that the previous filter
+    // said were missing. These were inserted with explicit IDs after the previous filter was built
+    bool prev_violated{};
+};
+
+// Builds an id_filter from a consistent snapshot of the table. prev is the filter being replaced, if any.
+// The filter must never yield false negatives, so it's only trusted up to a bound below which
+// no row can be committed after the snapshot is taken. Rows inserted without an explicit ID
+// get IDs from the table's AUTO_INCREMENT counter, so, if no transaction that was running
+// when the counter was read is still running when the snapshot is taken, the IDs below the counter
+// are safe. Reading INNODB_TRX requires the PROCESS privilege: without it, no filter is built.
+// Rows inserted with explicit IDs below the bound can't be detected as they happen.
+// They are detected when building the next filter (see id_filter_build::prev_violated).
+asio::awaitable<id_filter_build> build_id_filter(worker& w, std::shared_ptr<const id_filter> prev)
+{
+    using namespace std::chrono_literals;
+
+    // Read the AUTO_INCREMENT counter and the server time. The server caches table statistics
+    // by default, which would yield a stale counter
+    mysql::results result;
+    std::optional<std::int64_t> next_id;
+    mysql::datetime read_at;
+    {
+        mysql::pooled_connection conn = co_await w.pool.async_get_connection();
+        try
+        {
+            // We modify session state, so the connection will be reset, deallocating its statements
+            w.statements.invalidate(conn.get());
+            co_await conn->async_execute("SET SESSION information_schema_stats_expiry = 0", result);
+            co_await conn->async_execute(
+                "SELECT AUTO_INCREMENT FROM information_schema.TABLES "
+                "WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = 'correlations'",
+                result
+            );
+            if (!result.rows().empty() && !result.rows().at(0).at(0).is_null())
+                next_id = static_cast<std::int64_t>(result.rows().at(0).at(0).as_uint64());
+            co_await conn->async_execute("SELECT NOW()", result);
+            read_at = result.rows().at(0).at(0).as_datetime();
+        }
+        catch (...)
+        {
+            w.killer.kill_if_cancelled(conn, std::current_exception());
+            throw;
+        }
+    }
+
+    // Transactions that got IDs before the counter was read may still be running.
+    // Give short ones time to finish
+    asio::steady_timer timer(co_await asio::this_coro::executor, 2s);
+    co_await timer.async_wait();
+
+    mysql::pooled_connection conn = co_await w.pool.async_get_connection();
+    try
+    {
+        // If none of them is running now, none will commit after the snapshot is taken.
+        // trx_started has a resolution of seconds, so this may count a transaction too many, but not too few
+        co_await conn->async_execute(
+            mysql::with_params(
+                "SELECT COUNT(*) FROM information_schema.INNODB_TRX WHERE trx_started <= {}",
+                read_at
+            ),
+            result
+        );
+        bool old_transactions = result.rows().at(0).at(0).as_int64() != 0;
+
+        // All queries in the transaction see the same snapshot
+        co_await conn->async_execute("START TRANSACTION WITH CONSISTENT SNAPSHOT, READ ONLY", result);
+
+        // The previous bound is still safe, since this snapshot is newer
+        std::int64_t bound = prev ? prev->bound() : std::numeric_limits<std::int64_t>::min();
+        if (next_id && !old_transactions)
+            bound = std::max(bound, *next_id - 1);
+
+        // Size the filter
+        co_await conn->async_execute("SELECT COUNT(*) FROM correlations", result);
+        auto num_ids = static_cast<std::size_t>(result.rows().at(0).at(0).as_int64());
+        auto filter = std::make_shared<id_filter>(num_ids, bound);
+
+        // Add all IDs to the filter. The table may be big, so we read rows in batches,
+        // rather than loading them all in memory
+        bool prev_violated = false;
+        mysql::execution_state st;
+        co_await conn->async_start_execution("SELECT id FROM correlations", st);
+        while (!st.complete())
+        {
+            mysql::rows_view rows = co_await conn->async_read_some_rows(st);
+            for (auto row : rows)
+            {
+                std::int64_t id = row.at(0).as_int64();
+                filter->add(id);
+                if (prev && prev->definitely_missing(id))
+                    prev_violated = true;
+            }
+        }
+
+        co_await conn->async_execute("COMMIT", result);
+
+        // We didn't modify any session state
+        conn.return_without_reset();
+        co_return id_filter_build{std::move(filter), prev_violated};
+    }
+    catch (...)
+    {
+        // The connection will be reset, deallocating its statements
+        w.statements.invalidate(conn.get());
+        w.killer.kill_if_cancelled(conn, std::current_exception());
+        throw;
+    }
+}
+
+// Periodically rebuilds the ID filter, and hands it to all workers.
+// Runs in the first worker's thread, using its connection pool.
+asio::awaitable<void> run_id_filter_refresher(
+    std::span<const std::unique_ptr<worker>> workers,
+    std::chrono::seconds interval
+)
+{
+    using namespace std::chrono_literals;
+
+    worker& w = *workers.front();
+    asio::steady_timer timer(co_await asio::this_coro::executor);
+
+    // Each worker has its own pointer to the filter, so lookups don't need
+    // to synchronize. Replace it from the worker's own thread
+    auto publish = [workers](std::shared_ptr<const id_filter> filter) {
+        for (const auto& target : workers)
+            asio::post(target->ctx, [target = target.get(), ids = filter] { target->ids = ids; });
+    };
+
+    std::shared_ptr<const id_filter> current;
+    while (true)
+    {
+        try
+        {
+            auto [filter, prev_violated] = co_await asio::co_spawn(
+                timer.get_executor(),
+                build_id_filter(w, current),
+                asio::cancel_after(5min)
+            );
+            if (prev_violated)
+            {
+                // Rows are being inserted with explicit IDs, so the filter can't be trusted
+                std::cerr << "Rows were inserted with explicit IDs below the ID filter's bound. "
+                             "Disabling the filter"
+                          << std::endl;
+                publish(nullptr);
+                co_return;
+            }
+            current = filter;
+            publish(std::move(filter));
+        }
+        catch (const std::exception& err)
+        {
+            std::cerr << "Error refreshing the ID filter: " << err.what() << std::endl;
+        }
+
+        timer.expires_after(interval);
+        co_await timer.async_wait();
+    }
+}
+
+// Loads the rows that changed since base was built, applying them to base.
+// If base is null, loads the entire table. Returns base if nothing changed.
+// Rows are read in batches, so the table doesn't need to fit in memory twice.
+asio::awaitable<std::shared_ptr<const mirror_snapshot>> load_mirror(
+    worker& w,
+    std::shared_ptr<const mirror_snapshot> base,
+    std::chrono::seconds max_commit_delay
+)
+{
+    mysql::pooled_connection conn = co_await w.pool.async_get_connection();
+    try
+    {
+        mirror_builder builder;
+        mysql::execution_state st;
+        if (base)
+        {
+            // New rows have greater IDs than the ones we've seen, and updated rows
+            // have a greater updated_at. Transactions may commit after we've seen rows
+            // with greater values, so we re-read rows updated within max_commit_delay of the watermark.
+            // Unchanged rows are skipped by the builder, which only copies base if some row changed.
+            // Rows are read in ID order, so the builder can check the index's density
+            builder = mirror_builder(base);
+            mysql::statement stmt = co_await w.statements.get(
+                conn.get(),
+                "SELECT id, subject, updated_at FROM correlations WHERE id > ? OR updated_at >= ? ORDER BY id"
+            );
+            auto watermark = mysql::datetime(base->max_updated_at() - max_commit_delay);
+            co_await conn->async_start_execution(stmt.bind(base->max_id(), watermark), st);
+        }
+        else
+        {
+            co_await conn->async_start_execution(
+                "SELECT id, subject, updated_at FROM correlations ORDER BY id",
+                st
+            );
+        }
+
+        while (!st.complete())
+        {
+            mysql::rows_view rows = co_await conn->async_read_some_rows(st);
+            for (auto row : rows)
+            {
+                builder.set(
+                    row.at(0).as_int64(),
+                    row.at(1).as_string(),
+                    row.at(2).as_datetime().as_time_point()
+                );
+            }
+        }
+
+        // We didn't modify any session state
+        conn.return_without_reset();
+
+        if (base && !builder.changed())
+            co_return base;
+        co_return std::move(builder).build();
+    }
+    catch (...)
+    {
+        // The connection will be reset, deallocating its statements
+        w.statements.invalidate(conn.get());
+        w.killer.kill_if_cancelled(conn, std::current_exception());
+        throw;
+    }
+}
+
+// Attempts to parse a request from the bytes that are already in the buffer,
+// without performing any I/O. Clients may pipeline requests, sending several
+// of them without waiting for the responses.
+// Returns an empty optional if the buffer doesn't contain a complete request,
+// or if it contains an invalid one. In both cases, the bytes are left in the buffer,
+// so the next http::async_read call can deal with them.
+std::optional<http::request<http::empty_body>> parse_buffered_request(beast::flat_buffer& buff)
+{
+    http::request_parser<http::empty_body> parser;
+    parser.eager(true);
+    error_code ec;
+    std::size_t bytes_parsed = parser.put(buff.data(), ec);
+    if (ec || !parser.is_done())
+        return {};
+    buff.consume(bytes_parsed);
+    return parser.release();
+}
+
+// Handles several requests concurrently, waiting for all of them to finish.
+// Responses are returned in the same order as the requests.
+asio::awaitable<std::vector<response>> handle_requests(
+    worker& w,
+    std::span<const http::request<http::empty_body>> reqs,
+    const std::shared_ptr<readahead>& ra,
+    query_watch_list& queries,
+    std::chrono::steady_clock::time_point deadline
+)
+{
+    // Use the same executor as the parent coroutine.
+    // An executor represents a handle to an execution context (i.e. event loop)
+    auto ex = co_await asio::this_coro::executor;
+
+    // If we had written "co_await handle_request(w, req)", we would
+    // have had no way to run the requests concurrently or to specify a timeout.
+    // In this sense, we can classify async operations in Asio into two types:
+    //    - co_await handle_request(w, req) always uses C++20 coroutines.
+    //      These are easy to write, but less flexible.
+    //    - http::async_read(), asio::co_spawn() and other library functions
+    //      follow Asio's universal async model. That is, they can be passed
+    //      a completion token as last parameter. These are more difficult to
+    //      write, but are more flexible.
+    // asio::co_spawn() is actually an async operation, too. Passing asio::deferred
+    // as completion token creates an operation that hasn't been launched yet.
+    using op_type = decltype(
+        asio::co_spawn(ex, handle_request(w, reqs[0], ra, queries, deadline), asio::deferred)
+    );
+    std::vector<op_type> ops;
+    ops.reserve(reqs.size());
+    for (const auto& req : reqs)
+        ops.push_back(asio::co_spawn(ex, handle_request(w, req, ra, queries, deadline), asio::deferred));
+
+    // Launch all the operations and wait for them to finish.
+    // The requests must be handled before their deadline.
+    // If it's reached and some handle_request calls haven't finished,
+    // the async operations they are waiting for will be cancelled.
+    // This makes them finish with an error (similar to when a network error occurs).
+    // Note that a cancellation does NOT make the coroutine to "just stop executing".
+    auto group = asio::experimental::make_parallel_group(std::move(ops));
+    auto [completion_order, excs, responses] = co_await group.async_wait(
+        asio::experimental::wait_for_all(),
+        wheel_cancel_at(w.timeouts, deadline, asio::use_awaitable)
+    );
+
+    // Propagate any unhandled exception
+    for (const auto& exc : excs)
+    {
+        if (exc)
+            std::rethrow_exception(exc);
+    }
+
+    co_return std::move(responses);
+}
+
+// Writes several responses using a single gathered write, so a single
+// syscall may carry many responses. Responses are written with the HTTP version
+// of their request. keep_alive applies to the last response, while the others always keep
+// the connection alive. For Beast messages, serializers render the headers,
+// and bodies are written directly from the response objects, without copying.
+// Pre-serialized responses are written directly, patching in the version and the Connection header.
+// Streamed responses write themselves, after the responses before them have been flushed.
+// Returns whether the connection can be kept alive.
+asio::awaitable<bool> write_responses(
+    asio::ip::tcp::socket& sock,
+    timer_wheel& timeouts,
+    std::chrono::steady_clock::time_point deadline,
+    std::span<const http::request<http::empty_body>> reqs,
+    std::span<response> responses,
+    bool keep_alive
+)
+{
+    // The parts of pre-serialized responses that depend on the request
+    static constexpr std::string_view http10 = "HTTP/1.0", http11 = "HTTP/1.1";
+    static constexpr std::string_view connection_close = "Connection: close\r\n";
+    static constexpr std::string_view connection_keep_alive = "Connection: keep-alive\r\n";
+
+    // The buffers point into the serializers, which must be kept alive until
+    // the write completes. std::deque never moves its elements
+    std::deque<http::response_serializer<http::string_body>> serializers;
+    std::vector<asio::const_buffer> buffers;
+    for (std::size_t i = 0; i < responses.size(); ++i)
+    {
+        unsigned version = reqs[i].version();
+        bool res_keep_alive = reqs[i].keep_alive() && (keep_alive || i + 1 < responses.size());
+
+        if (auto* msg = std::get_if<http::response<http::string_body>>(&responses[i]))
+        {
+            msg->version(version);
+            msg->keep_alive(res_keep_alive);
+            msg->prepare_payload();
+
+            // Since string_body knows its size beforehand, a single call to next()
+            // yields both the header and the body
+            error_code ec;
+            serializers.emplace_back(*msg).next(ec, [&buffers](error_code&, const auto& msg_buffers) {
+                for (asio::const_buffer buff : beast::buffers_range_ref(msg_buffers))
+                    buffers.push_back(buff);
+            });
+            if (ec)
+                throw boost::system::system_error(ec);
+        }
+        else if (auto* streamed = std::get_if<std::shared_ptr<streamed_response>>(&responses[i]))
+        {
+            if (!buffers.empty())
+            {
+                co_await asio::async_write(sock, buffers, wheel_cancel_at(timeouts, deadline));
+                buffers.clear();
+                serializers.clear();
+            }
+            if (!co_await (*streamed)->write(sock, version, res_keep_alive, deadline))
+                co_return false;
+        }
+        else
+        {
+            // HTTP/1.1 connections are persistent by default, and HTTP/1.0 ones are not
+            const auto& res = *std::get<std::shared_ptr<const serialized_response>>(responses[i]);
+            buffers.push_back(asio::buffer(version == 10 ? http10 : http11));
+            buffers.push_back(res.head());
+            if (version == 10 && res_keep_alive)
+                buffers.push_back(asio::buffer(connection_keep_alive));
+            else if (version != 10 && !res_keep_alive)
+                buffers.push_back(asio::buffer(connection_close));
+            buffers.push_back(res.tail());
+        }
+    }
+
+    // Send the responses before the deadline
+    if (!buffers.empty())
+        co_await asio::async_write(sock, buffers, wheel_cancel_at(timeouts, deadline));
+    co_return keep_alive;
+}
+
+// Watches the connection while its requests are being handled. If the client resets it,
+// kills the queries run by the requests (see query_watch_list), so they fail with a server error
+// and their connections are reset and reused, rather than reconnected. Completing cancels the requests
+// (see run_session), so this only completes if none of them is running a query, or if they haven't
+// finished within query_killer::grace_period (e.g. because they're waiting for a lookup shared
+// with other requests, or the server didn't react).
+// Peeking doesn't consume any bytes. A clean EOF doesn't mean that the client is gone:
+// it may have shut down its side after sending its requests, and still be reading the responses.
+// If it's gone, writing them fails. After EOF or more data (e.g. pipelined requests),
+// we can't learn anything else without reading, so we wait until cancelled.
+asio::awaitable<void> watch_peer(asio::ip::tcp::socket& sock, query_watch_list& queries)
+{
+    char byte{};
+    auto [ec, bytes_read] = co_await sock.async_receive(
+        asio::buffer(&byte, 1),
+        asio::socket_base::message_peek,
+        asio::as_tuple(asio::use_awaitable)
+    );
+    if (ec == asio::error::operation_aborted)
+        co_return;
+
+    asio::steady_timer timer(sock.get_executor(), asio::steady_timer::time_point::max());
+    if (ec && ec != asio::error::eof)
+    {
+        if (queries.abandon() == 0)
+            co_return;
+        timer.expires_after(query_killer::grace_period);
+    }
+    co_await timer.async_wait(asio::as_tuple(asio::use_awaitable));
+}
+
+// Runs an individual HTTP session: reads requests, processes them,
+// and writes the responses back, until the client closes the connection,
+// the connection stays idle for too long or we reach the maximum
+// number of requests per connection.
+// Pipelined requests are handled concurrently, and their responses
+// are written back in order.
+asio::awaitable<void> run_session(
+    worker& w,
+    const server_config& cfg,
+    asio::ip::tcp::socket sock
+)
+{
+    // The buffer is reused for all the requests in the session.
+    // After reading a request, it may contain bytes belonging to the next ones.
+    beast::flat_buffer buff;
+
+    // Detects sequential scans. Prefetches that outlive the session
+    // hold weak references to it
+    auto ra = std::make_shared<readahead>(cfg.max_readahead);
+
+    // The queries run by the requests being handled, killed if the client goes away
+    query_watch_list queries;
+
+    // Have we reached the maximum number of requests for this connection?
+    std::size_t num_requests = 0;
+    auto limit_reached = [&cfg, &num_requests] {
+        return cfg.max_requests_per_connection != 0 && num_requests >= cfg.max_requests_per_connection;
+    };
+
+    while (true)
+    {
+        // Wait until the client starts sending the next request.
+        // This is subject to the idle timeout, rather than to the read timeout.
+        // asio::as_tuple makes the operation return an error code instead of throwing:
+        // an idle connection is not an error, so we just close it.
+        if (buff.size() == 0)
+        {
+            auto [ec] = co_await sock.async_wait(
+                asio::socket_base::wait_read,
+                wheel_cancel_after(w.timeouts, cfg.idle_timeout, asio::as_tuple(asio::use_awaitable))
+            );
+            if (ec)
+                co_return;
+        }
+
+        // The request has started arriving. Reading it, handling it and writing
+        // the response share a single time budget, so a slow stage leaves less time
+        // for the next ones, and nobody holds resources for a request that we won't answer on time.
+        // Pipelined requests share the budget of the first one
+        auto deadline = std::chrono::steady_clock::now() + cfg.request_timeout;
+
+        // Read a request. We say that http::async_read is an Asio composed operation:
+        // it calls asio::ip::tcp::socket::async_read_some() several times, until
+        // the entire HTTP request is read.
+        // The last argument to http::async_read() is the completion token:
+        // it specifies what to do when the async operation completes.
+        // asio::cancel_at is a completion token that can be used to specify timeouts:
+        // if the operation does not complete before the deadline, a cancellation is issued,
+        // and the operation finishes with an error. wheel_cancel_at does the same,
+        // using the worker's timer wheel instead of a timer per operation.
+        // The client closing the connection between requests is not an error.
+        std::vector<http::request<http::empty_body>> reqs(1);
+        auto [ec, bytes_read] = co_await http::async_read(
+            sock,
+            buff,
+            reqs.front(),
+            wheel_cancel_at(w.timeouts, deadline, asio::as_tuple(asio::use_awaitable))
+        );
+        if (ec == http::error::end_of_stream)
+            co_return;
+        else if (ec)
+            throw boost::system::system_error(ec);
+        ++num_requests;
+
+        // If the client pipelined more requests, they may already be in the buffer.
+        // Collect them, so they're handled concurrently. A request that doesn't
+        // want the connection kept alive must be the last one.
+        while (reqs.size() < cfg.max_pipeline_depth && reqs.back().keep_alive() && !limit_reached())
+        {
+            auto req = parse_buffered_request(buff);
+            if (!req)
+                break;
+            reqs.push_back(std::move(*req));
+            ++num_requests;
+        }
+
+        // Handle the requests. If the client goes away in the meantime, nobody will read
+        // the responses: stop the handlers, so they release their database connections (see watch_peer).
+        // Whichever operation finishes first cancels the other one
+        auto group = asio::experimental::make_parallel_group(
+            asio::co_spawn(
+                sock.get_executor(),
+                handle_requests(w, reqs, ra, queries, deadline),
+                asio::deferred
+            ),
+            asio::co_spawn(sock.get_executor(), watch_peer(sock, queries), asio::deferred)
+        );
+        auto [completion_order, handler_exc, responses, watcher_exc] = co_await group.async_wait(
+            asio::experimental::wait_for_one(),
+            asio::use_awaitable
+        );
+        if (queries.abandoned())
+        {
+            w.metrics.abandoned_requests.fetch_add(reqs.size(), std::memory_order_relaxed);
+            co_return;
+        }
+        if (handler_exc)
+            std::rethrow_exception(handler_exc);
+
+        // Send the responses back.
+        // We keep the connection open if the client asked for it,
+        // unless we've reached the maximum number of requests for this connection.
+        bool keep_alive = reqs.back().keep_alive() && !limit_reached();
+        keep_alive = co_await write_responses(sock, w.timeouts, deadline, reqs, responses, keep_alive);
+
+        // If we're not keeping the connection alive, signal the client that we're done
+        if (!keep_alive)
+        {
+            error_code ignored;
+            sock.shutdown(asio::socket_base::shutdown_send, ignored);
+            co_return;
+        }
+    }
+}
+
+// A binary protocol response that's ready to be written
+struct binary_response
+{
+    // The frame size, request ID and status
+    std::array<unsigned char, binary_frame_prefix_size + binary_response_header_size> header;
+
+    // The subject, and an object keeping it alive (a cached response or a mirror snapshot)
+    std::shared_ptr<const void> owner;
+    std::string_view subject;
+
+    binary_response(
+        std::uint32_t request_id,
+        binary_status status,
+        std::shared_ptr<const void> owner,
+        std::string_view subject
+    )
+        : owner(std::move(owner)), subject(subject)
+    {
+        store_big_endian(header.data(), binary_response_header_size + subject.size(), 4);
+        store_big_endian(header.data() + 4, request_id, 4);
+        header[8] = static_cast<unsigned char>(status);
+    }
+};
+
+// The state of a binary protocol connection, shared by the coroutine reading requests,
+// the ones handling them, and the one writing responses
+struct binary_session
+{
+    asio::ip::tcp::socket sock;
+
+    // Responses waiting to be written
+    std::vector<binary_response> ready;
 
-    // Attempt to parse the ID following the prefix
-    std::int64_t res{};
-    auto from_chars_res = std::from_chars(target.begin() + prefix.size(), target.end(), res);
-    if (from_chars_res.ec != std::errc{})
-        return {};
-    if (from_chars_res.ptr != target.end())
-        return {};
+    // Requests that have been read, but whose responses haven't been written yet
+    std::size_t in_flight{};
 
-    // Done
-    return res;
-}
+    // Set when no more requests will be read
+    bool reading_done{};
 
-// Handles an individual HTTP request.
-// This function accesses the SQL database, performing async operations,
-// so it's a C++20 coroutine. Coroutines in Asio return asio::awaitable<T>,
-// where T is the type to co_return from the coroutine.
-// We will set a timeout to the entire coroutine (see the call site).
-asio::awaitable<http::response<http::string_body>> handle_request(
-    mysql::connection_pool& pool,               // contains connections to the database
-    const http::request<http::empty_body>& req  // HTTP request
+    // Set when writing failed. No more responses can be written
+    bool writing_failed{};
+
+    // These timers never expire. Cancelling them notifies the writer of new responses,
+    // and the reader that responses have been written, respectively
+    asio::steady_timer responses_ready;
+    asio::steady_timer responses_written;
+
+    explicit binary_session(asio::ip::tcp::socket s)
+        : sock(std::move(s)),
+          responses_ready(sock.get_executor()),
+          responses_written(sock.get_executor())
+    {
+    }
+};
+
+// Handles an individual binary protocol request, queueing its response
+asio::awaitable<void> handle_binary_request(
+    worker& w,
+    std::shared_ptr<binary_session> s,
+    std::uint32_t request_id,
+    std::int64_t id,
+    std::shared_ptr<readahead> ra,
+    std::chrono::steady_clock::time_point deadline
 )
 {
-    // The response to return
-    http::response<http::string_body> res;
-
+    std::shared_ptr<const void> owner;
+    std::string_view subject;
+    binary_status status = binary_status::not_found;
     try
     {
-        // Parse the request
-        std::optional<std::int64_t> employee_id = parse_request(req);
-        if (!employee_id)
+        if (w.mirror)
         {
-            res.result(http::status::bad_request);  // HTTP 400
-            co_return res;
+            // Keep the snapshot alive while the response is written
+            if (auto mirror_subject = w.mirror->get(id))
+            {
+                owner = w.mirror;
+                subject = *mirror_subject;
+                status = binary_status::ok;
+            }
         }
-
-        // Get a connection to the database server from the pool.
-        // If no connection is available, this will wait one is ready.
-        mysql::pooled_connection conn = co_await pool.async_get_connection();
-
-        // Query the database using dynamic SQL
-        mysql::results query_result;
-        co_await conn->async_execute(
-            mysql::with_params("SELECT last_name FROM employee WHERE id = {}", employee_id),
-            query_result
-        );
-
-        // If the query didn't get any row back, return a 404
-        if (query_result.rows().empty())
+        else if (auto cached = co_await lookup_response(w, id, ra, deadline))
         {
-            res.result(http::status::not_found);
-            co_return res;
+            // Subjects in cached responses are written without copying them
+            subject = cached->body();
+            owner = std::move(cached);
+            status = binary_status::ok;
         }
-
-        // Return the response
-        res.body() = query_result.rows().at(0).at(0).as_string();
-        co_return res;
     }
     catch (const std::exception& err)
     {
-        // If any of the above operations encountered an error,
-        // an exception is thrown. This can happen if the server
-        // is unhealthy, the server returns an error when running the query,
-        // or the coroutine gets cancelled.
         std::cerr << "Error while handling request: " << err.what() << std::endl;
-        res.result(http::status::internal_server_error);  // 500 error
-        co_return res;
+        owner = nullptr;
+        subject = {};
+        status = binary_status::error;
     }
+
+    s->ready.emplace_back(request_id, status, std::move(owner), subject);
+    s->responses_ready.cancel();
 }
 
-// Runs an individual HTTP session: reads a request,
-// processes it, and writes the response.
-asio::awaitable<void> run_session(mysql::connection_pool& pool, asio::ip::tcp::socket sock)
+// Writes the responses of a binary protocol session as they become ready.
+// Responses that become ready while a write is in progress are sent together in the next one.
+// Each write must complete within write_timeout
+asio::awaitable<void> write_binary_responses(
+    std::shared_ptr<binary_session> s,
+    timer_wheel& timeouts,
+    std::chrono::steady_clock::duration write_timeout
+)
 {
-    using namespace std::chrono_literals;
+    std::vector<binary_response> batch;
+    std::vector<asio::const_buffer> buffers;
+    while (true)
+    {
+        // Wait for responses. Once the reader is done, we're done when all responses are written
+        while (s->ready.empty())
+        {
+            if (s->reading_done && s->in_flight == 0)
+            {
+                error_code ignored;
+                s->sock.shutdown(asio::socket_base::shutdown_send, ignored);
+                co_return;
+            }
+            s->responses_ready.expires_at(asio::steady_timer::time_point::max());
+            co_await s->responses_ready.async_wait(asio::as_tuple(asio::use_awaitable));
+        }
 
-    // Read a request. We say that http::async_read is an Asio composed operation:
-    // it calls asio::ip::tcp::socket::async_read_some() several times, until
-    // the entire HTTP request is read.
-    // The last argument to http::async_read() is the completion token:
-    // it specifies what to do when the async operation completes.
-    // If nothing is specified, Asio returns an object that can be co_await'ed.
-    // asio::cancel_after is a completion token that can be used to specify timeouts:
-    // if the operation does not complete in 60 seconds, a cancellation is issued,
-    // and the operation finishes with an error.
-    // By default, asio::cancel_after() also turns the operation into an awaitable.
-    beast::flat_buffer buff;
-    http::request<http::empty_body> req;
-    co_await http::async_read(sock, buff, req, asio::cancel_after(60s));
+        // Write them with a single gathered write
+        batch.swap(s->ready);
+        buffers.clear();
+        for (const auto& res : batch)
+        {
+            buffers.push_back(asio::buffer(res.header));
+            buffers.push_back(asio::buffer(res.subject));
+        }
+        co_await asio::async_write(s->sock, buffers, wheel_cancel_after(timeouts, write_timeout));
 
-    // Handle the request. We want to limit the overall time taken by
-    // the request to 30 seconds.
-    // If we had written "co_await handle_request(pool, req)", we would
-    // have had no way to specify the timeout.
-    // In this sense, we can classify async operations in Asio into two types:
-    //    - co_await handle_request(pool, req) always uses C++20 coroutines.
-    //      These are easy to write, but less flexible.
-    //    - http::async_read(), asio::co_spawn() and other library functions
-    //      follow Asio's universal async model. That is, they can be passed
-    //      a completion token as last parameter. These are more difficult to
-    //      write, but are more flexible.
-    // asio::co_spawn() is actually an async operation, too, so we can co_await it.
-    // If the timeout elapses and handle_request hasn't finished, the async
-    // operation that handle_request() is waiting for will be cancelled.
-    // This makes it finish with an error (similar to when a network error occurs).
-    // Note that a cancellation does NOT make the coroutine to "just stop executing".
-    http::response<http::string_body> res = co_await asio::co_spawn(
-        // Use the same executor as the parent coroutine.
-        // An executor represents a handle to an execution context (i.e. event loop)
-        co_await asio::this_coro::executor,
+        s->in_flight -= batch.size();
+        batch.clear();
+        s->responses_written.cancel();
+    }
+}
 
-        // The coroutine to actually execute
-        [&] { return handle_request(pool, req); },
+// Runs a binary protocol session: reads requests and launches their handlers,
+// until the client closes the connection, stays idle for too long or sends an invalid frame.
+// At most max_pipeline_depth requests are handled at once: once this limit is reached,
+// no more requests are read until responses are written, so slow clients
+// don't make us queue responses without bounds.
+asio::awaitable<void> run_binary_session(worker& w, const server_config& cfg, asio::ip::tcp::socket sock)
+{
+    auto ex = co_await asio::this_coro::executor;
+    auto s = std::make_shared<binary_session>(std::move(sock));
+    auto ra = std::make_shared<readahead>(cfg.max_readahead);
 
-        // The completion token for the coroutine
-        asio::cancel_after(30s)
+    // Responses are written by a separate coroutine. If writing fails, the connection is closed,
+    // which makes reading fail, too. Like HTTP responses, writes must complete within the request timeout
+    asio::co_spawn(
+        ex,
+        write_binary_responses(s, w.timeouts, cfg.request_timeout),
+        [s](std::exception_ptr exc) {
+            if (exc)
+            {
+                s->writing_failed = true;
+                s->responses_written.cancel();
+                error_code ignored;
+                s->sock.close(ignored);
+                log_exception(exc);
+            }
+        }
     );
 
-    // Send the response, specifying a timeout.
-    // More complex versions could support HTTP keep alive, handling requests
-    // in a loop.
-    res.version(req.version());
-    res.keep_alive(false);
-    res.prepare_payload();
-    co_await http::async_write(sock, res, asio::cancel_after(60s));
+    // Requests are small, so many of them may be read at once
+    beast::flat_buffer buff;
+    while (true)
+    {
+        // Handle the complete requests in the buffer
+        while (buff.size() >= binary_frame_prefix_size)
+        {
+            auto data = static_cast<const unsigned char*>(buff.data().data());
+            if (load_big_endian(data, 4) != binary_request_size)
+            {
+                std::cerr << "Invalid binary protocol frame" << std::endl;
+                error_code ignored;
+                s->sock.shutdown(asio::socket_base::shutdown_receive, ignored);
+                s->reading_done = true;
+                s->responses_ready.cancel();
+                co_return;
+            }
+            if (buff.size() < binary_frame_prefix_size + binary_request_size)
+                break;
+            auto request_id = static_cast<std::uint32_t>(load_big_endian(data + 4, 4));
+            auto id = static_cast<std::int64_t>(load_big_endian(data + 8, 8));
+            buff.consume(binary_frame_prefix_size + binary_request_size);
+
+            // Wait until we're allowed to handle more requests
+            while (s->in_flight >= cfg.max_pipeline_depth && !s->writing_failed)
+            {
+                s->responses_written.expires_at(asio::steady_timer::time_point::max());
+                co_await s->responses_written.async_wait(asio::as_tuple(asio::use_awaitable));
+            }
+            if (s->writing_failed)
+                co_return;
+
+            // Launch the request. Like HTTP requests, it has a deadline.
+            // Responses are written as they complete, so writes don't draw from it
+            ++s->in_flight;
+            w.metrics.binary_requests.fetch_add(1, std::memory_order_relaxed);
+            auto deadline = std::chrono::steady_clock::now() + cfg.request_timeout;
+            asio::co_spawn(
+                ex,
+                handle_binary_request(w, s, request_id, id, ra, deadline),
+                wheel_cancel_at(w.timeouts, deadline, asio::detached)
+            );
+        }
+
+        // Read more requests. A connection is idle if it has no requests in flight
+        // and it's not sending any. Requests in flight complete within the request timeout,
+        // after which the connection may stay idle for the idle timeout
+        auto [ec, bytes_read] = co_await s->sock.async_read_some(
+            buff.prepare(4096),
+            wheel_cancel_after(
+                w.timeouts,
+                s->in_flight == 0 ? cfg.idle_timeout : cfg.request_timeout + cfg.idle_timeout,
+                asio::as_tuple(asio::use_awaitable)
+            )
+        );
+        if (ec)
+        {
+            // Let the writer send the responses in flight, and then close the connection
+            s->reading_done = true;
+            s->responses_ready.cancel();
+            co_return;
+        }
+        buff.commit(bytes_read);
+    }
 }
 
-// The main coroutine
-asio::awaitable<void> listener(mysql::connection_pool& pool, unsigned short port)
+// Creates an acceptor listening on the given port
+asio::ip::tcp::acceptor open_acceptor(asio::any_io_executor ex, unsigned short port, const server_config& cfg)
 {
     // An object that allows us to accept incoming TCP connections.
-    asio::ip::tcp::acceptor acceptor(co_await asio::this_coro::executor);
+    asio::ip::tcp::acceptor acceptor(std::move(ex));
 
     // The endpoint where the server will listen. Edit this if you want to
-    // change the address or port we bind to.
+    // change the address we bind to.
     asio::ip::tcp::endpoint listening_endpoint(asio::ip::make_address("0.0.0.0"), port);
 
     // Open the acceptor
@@ -234,11 +4284,26 @@ asio::awaitable<void> listener(mysql::connection_pool& pool, unsigned short port
     // Allow address reuse
     acceptor.set_option(asio::socket_base::reuse_address(true));
 
+    // In thread-per-core mode, each thread binds its own acceptor to the same port,
+    // and the kernel spreads incoming connections between them
+#ifdef SO_REUSEPORT
+    if (cfg.num_threads > 1)
+        acceptor.set_option(reuse_port_option(true));
+#endif
+
     // Bind to the server address
     acceptor.bind(listening_endpoint);
 
     // Start listening for connections
     acceptor.listen();
+    return acceptor;
+}
+
+// The main coroutine. In thread-per-core mode, several threads
+// run a listener bound to the same port.
+asio::awaitable<void> listener(worker& w, const server_config& cfg)
+{
+    auto acceptor = open_acceptor(co_await asio::this_coro::executor, cfg.http_port, cfg);
     std::cout << "Server listening at " << acceptor.local_endpoint() << std::endl;
 
     // Accept connections in a loop
@@ -255,7 +4320,29 @@ asio::awaitable<void> listener(mysql::connection_pool& pool, unsigned short port
         // The callback will be called when the coroutine completes.
         asio::co_spawn(
             co_await asio::this_coro::executor,
-            [socket = std::move(sock), &pool]() mutable { return run_session(pool, std::move(socket)); },
+            [socket = std::move(sock), &w, &cfg]() mutable { return run_session(w, cfg, std::move(socket)); },
+            [](std::exception_ptr exc) {
+                if (exc)
+                    log_exception(exc);
+            }
+        );
+    }
+}
+
+// Accepts binary protocol connections
+asio::awaitable<void> binary_listener(worker& w, const server_config& cfg)
+{
+    auto acceptor = open_acceptor(co_await asio::this_coro::executor, cfg.binary_port, cfg);
+    std::cout << "Binary protocol server listening at " << acceptor.local_endpoint() << std::endl;
+
+    while (true)
+    {
+        auto sock = co_await acceptor.async_accept();
+        asio::co_spawn(
+            co_await asio::this_coro::executor,
+            [socket = std::move(sock), &w, &cfg]() mutable {
+                return run_binary_session(w, cfg, std::move(socket));
+            },
             [](std::exception_ptr exc) {
                 if (exc)
                     log_exception(exc);
@@ -264,52 +4351,507 @@ asio::awaitable<void> listener(mysql::connection_pool& pool, unsigned short port
     }
 }
 
+// Starts accepting HTTP connections in the given worker,
+// and binary protocol ones, if enabled
+void start_listener(worker& w, const server_config& cfg)
+{
+    auto on_error = [](std::exception_ptr exc) {
+        if (exc)
+            std::rethrow_exception(exc);
+    };
+    asio::co_spawn(w.ctx, [&w, &cfg] { return listener(w, cfg); }, on_error);
+    if (cfg.binary_port != 0)
+        asio::co_spawn(w.ctx, [&w, &cfg] { return binary_listener(w, cfg); }, on_error);
+}
+
+// Starts the background tasks that serving requests from the database requires:
+// refreshing the cache and the ID filter. Not needed in mirror mode.
+// The workers must outlive the tasks. Thread-safe
+void start_database_tasks(std::span<const std::unique_ptr<worker>> workers, const server_config& cfg)
+{
+    auto on_error = [](std::exception_ptr exc) {
+        if (exc)
+            log_exception(exc);
+    };
+
+    // Refresh stale cache entries in the background
+    if (cfg.cache_max_staleness.count() != 0 || cfg.num_hot_keys != 0)
+    {
+        for (const auto& w : workers)
+        {
+            asio::co_spawn(
+                w->ctx,
+                [w = w.get(), max_batch_size = cfg.max_batch_size] {
+                    return run_cache_refresher(*w, max_batch_size);
+                },
+                on_error
+            );
+        }
+    }
+
+    // Keep the most requested IDs in the cache
+    if (cfg.num_hot_keys != 0)
+    {
+        for (std::size_t i = 0; i < workers.size(); ++i)
+        {
+            asio::co_spawn(
+                workers[i]->ctx,
+                [w = workers[i].get(), rotate = i == 0, window = cfg.hot_key_window] {
+                    return run_hot_key_prefetcher(*w, rotate, window);
+                },
+                on_error
+            );
+        }
+    }
+
+    // Keep the filter of existing IDs up to date
+    if (cfg.id_filter_refresh_interval.count() != 0)
+    {
+        asio::co_spawn(
+            workers.front()->ctx,
+            [workers, interval = cfg.id_filter_refresh_interval] {
+                return run_id_filter_refresher(workers, interval);
+            },
+            on_error
+        );
+    }
+}
+
+// Saves a mirror snapshot to a file. Writing the file blocks,
+// so this is run in a separate thread
+asio::awaitable<void> save_mirror(std::shared_ptr<const mirror_snapshot> snapshot, std::string path)
+{
+    snapshot->save(path);
+    co_return;
+}
+
+// Runs the server in mirror mode. Loads the entire table, hands it to all workers
+// and starts accepting connections. Then, periodically picks up changes.
+// If there's a mirror file, it's loaded instead of the table, and then brought up to date
+// by the first sync. Runs in the first worker's thread, using its connection pool.
+// If the table's IDs are too sparse to mirror, falls back to serving requests from the database,
+// starting the tasks that this requires (see start_database_tasks).
+asio::awaitable<void> run_mirror(std::span<const std::unique_ptr<worker>> workers, const server_config& cfg)
+{
+    using namespace std::chrono_literals;
+
+    worker& w = *workers.front();
+    auto ex = co_await asio::this_coro::executor;
+
+    // Each worker has its own pointer to the snapshot, so lookups don't need
+    // to synchronize. Replace it from the worker's own thread
+    auto publish = [workers](const std::shared_ptr<const mirror_snapshot>& snapshot) {
+        for (const auto& target : workers)
+            asio::post(target->ctx, [target = target.get(), snapshot] { target->mirror = snapshot; });
+    };
+
+    // Try the mirror file first
+    std::shared_ptr<const mirror_snapshot> snapshot;
+    if (!cfg.mirror_file.empty())
+    {
+        try
+        {
+            snapshot = std::make_shared<const mirror_snapshot>(cfg.mirror_file);
+            std::cout << "Loaded " << snapshot->num_rows() << " rows from " << cfg.mirror_file << std::endl;
+        }
+        catch (const std::exception& err)
+        {
+            std::cerr << "Not using mirror file " << cfg.mirror_file << ": " << err.what() << std::endl;
+        }
+    }
+
+    // Load the table. If the IDs are too sparse, serve requests from the database instead.
+    // If this fails for any other reason, the server exits
+    bool loaded_from_file = snapshot != nullptr;
+    if (!loaded_from_file)
+    {
+        try
+        {
+            snapshot = co_await asio::co_spawn(
+                ex,
+                load_mirror(w, nullptr, cfg.mirror_sync_interval),
+                asio::cancel_after(5min)
+            );
+            std::cout << "Loaded " << snapshot->num_rows() << " rows into the mirror" << std::endl;
+        }
+        catch (const mirror_too_sparse& err)
+        {
+            std::cerr << err.what() << ". Serving requests from the database" << std::endl;
+        }
+    }
+    if (!snapshot)
+    {
+        for (const auto& target : workers)
+            start_listener(*target, cfg);
+        start_database_tasks(workers, cfg);
+        co_return;
+    }
+    publish(snapshot);
+
+    // Handlers posted to an io_context run in order, so workers get the snapshot
+    // before they accept any connection
+    for (const auto& target : workers)
+        start_listener(*target, cfg);
+
+    // Writing files blocks, so it's done in a separate thread
+    asio::thread_pool save_thread(1);
+    bool unsaved_changes = !loaded_from_file;
+    std::optional<std::chrono::steady_clock::time_point> last_save;
+
+    // Pick up changes. We assume that write transactions take less than the sync interval.
+    // The file may be stale, so bring it up to date straight away
+    asio::steady_timer timer(ex);
+    for (bool first = true;; first = false)
+    {
+        if (!(first && loaded_from_file))
+        {
+            timer.expires_after(cfg.mirror_sync_interval);
+            co_await timer.async_wait();
+        }
+
+        try
+        {
+            auto next = co_await asio::co_spawn(
+                ex,
+                load_mirror(w, snapshot, cfg.mirror_sync_interval),
+                asio::cancel_after(5min)
+            );
+            if (next != snapshot)
+            {
+                snapshot = std::move(next);
+                publish(snapshot);
+                unsaved_changes = true;
+            }
+        }
+        catch (const mirror_too_sparse& err)
+        {
+            // Leave mirror mode. Workers serve requests from the database when they don't have a snapshot
+            std::cerr << err.what() << ". Serving requests from the database" << std::endl;
+            publish(nullptr);
+            start_database_tasks(workers, cfg);
+            co_return;
+        }
+        catch (const std::exception& err)
+        {
+            std::cerr << "Error syncing the mirror: " << err.what() << std::endl;
+        }
+
+        // Save the snapshot, at most once every save interval
+        auto now = std::chrono::steady_clock::now();
+        if (!cfg.mirror_file.empty() && unsaved_changes &&
+            (!last_save || now - *last_save >= cfg.mirror_save_interval))
+        {
+            try
+            {
+                last_save = now;
+                co_await asio::co_spawn(
+                    save_thread,
+                    save_mirror(snapshot, cfg.mirror_file),
+                    asio::use_awaitable
+                );
+                unsaved_changes = false;
+            }
+            catch (const std::exception& err)
+            {
+                std::cerr << "Error saving the mirror file: " << err.what() << std::endl;
+            }
+        }
+    }
+}
+
+// Parses the command line. Returns an empty optional if it's not valid.
+std::optional<server_config> parse_config(int argc, char** argv)
+{
+    if (argc < 5)
+        return {};
+
+    server_config res{
+        .db_username = argv[1],
+        .db_password = argv[2],
+        .db_hostname = argv[3],
+    };
+    if (!parse_flag_value(argv[4], res.http_port))
+        return {};
+
+    // Optional flags, with the form --name=value
+    for (int i = 5; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+        auto eq_pos = arg.find('=');
+        if (!arg.starts_with("--") || eq_pos == std::string_view::npos)
+            return {};
+        std::string_view name = arg.substr(2, eq_pos - 2);
+        std::string_view value = arg.substr(eq_pos + 1);
+
+        if (name == "threads")
+        {
+            if (!parse_flag_value(value, res.num_threads))
+                return {};
+
+            // --threads=0 means one thread per core we may run on
+            if (res.num_threads == 0)
+            {
+                res.num_threads = usable_cpus().size();
+                if (res.num_threads == 0)
+                    res.num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+            }
+        }
+        else if (name == "binary-port")
+        {
+            if (!parse_flag_value(value, res.binary_port))
+                return {};
+        }
+        else if (name == "idle-timeout")
+        {
+            std::chrono::seconds::rep seconds{};
+            if (!parse_flag_value(value, seconds))
+                return {};
+            res.idle_timeout = std::chrono::seconds(seconds);
+        }
+        else if (name == "request-timeout")
+        {
+            std::chrono::seconds::rep seconds{};
+            if (!parse_flag_value(value, seconds) || seconds <= 0)
+                return {};
+            res.request_timeout = std::chrono::seconds(seconds);
+        }
+        else if (name == "max-requests")
+        {
+            if (!parse_flag_value(value, res.max_requests_per_connection))
+                return {};
+        }
+        else if (name == "pipeline-depth")
+        {
+            if (!parse_flag_value(value, res.max_pipeline_depth) || res.max_pipeline_depth == 0)
+                return {};
+        }
+        else if (name == "max-batch-size")
+        {
+            if (!parse_flag_value(value, res.max_batch_size) || res.max_batch_size == 0)
+                return {};
+        }
+        else if (name == "batch-window-us")
+        {
+            std::chrono::microseconds::rep microseconds{};
+            if (!parse_flag_value(value, microseconds))
+                return {};
+            res.batch_window = std::chrono::microseconds(microseconds);
+        }
+        else if (name == "cache-size-mb")
+        {
+            std::size_t megabytes{};
+            if (!parse_flag_value(value, megabytes))
+                return {};
+            res.cache_memory_budget = megabytes * 1024 * 1024;
+        }
+        else if (name == "cache-ttl")
+        {
+            std::chrono::seconds::rep seconds{};
+            if (!parse_flag_value(value, seconds))
+                return {};
+            res.cache_ttl = std::chrono::seconds(seconds);
+        }
+        else if (name == "cache-max-stale")
+        {
+            std::chrono::seconds::rep seconds{};
+            if (!parse_flag_value(value, seconds))
+                return {};
+            res.cache_max_staleness = std::chrono::seconds(seconds);
+        }
+        else if (name == "max-lookup-ids")
+        {
+            if (!parse_flag_value(value, res.max_ids_per_lookup) || res.max_ids_per_lookup == 0)
+                return {};
+        }
+        else if (name == "readahead")
+        {
+            if (!parse_flag_value(value, res.max_readahead) || res.max_readahead < 0)
+                return {};
+        }
+        else if (name == "hot-keys")
+        {
+            if (!parse_flag_value(value, res.num_hot_keys))
+                return {};
+        }
+        else if (name == "hot-key-window")
+        {
+            std::chrono::seconds::rep seconds{};
+            if (!parse_flag_value(value, seconds) || seconds <= 0)
+                return {};
+            res.hot_key_window = std::chrono::seconds(seconds);
+        }
+        else if (name == "id-filter-refresh")
+        {
+            std::chrono::seconds::rep seconds{};
+            if (!parse_flag_value(value, seconds))
+                return {};
+            res.id_filter_refresh_interval = std::chrono::seconds(seconds);
+        }
+        else if (name == "mirror-sync")
+        {
+            std::chrono::seconds::rep seconds{};
+            if (!parse_flag_value(value, seconds))
+                return {};
+            res.mirror_sync_interval = std::chrono::seconds(seconds);
+        }
+        else if (name == "mirror-file")
+        {
+            res.mirror_file = value;
+        }
+        else if (name == "mirror-save")
+        {
+            std::chrono::seconds::rep seconds{};
+            if (!parse_flag_value(value, seconds))
+                return {};
+            res.mirror_save_interval = std::chrono::seconds(seconds);
+        }
+        else
+        {
+            return {};
+        }
+    }
+
+    return res;
+}
+
+// Pins the calling thread to one of the given CPUs (as returned by usable_cpus),
+// so the kernel doesn't migrate it between cores, thrashing caches.
+// This is an optimization, so failure is not considered an error.
+void pin_to_core(std::size_t index, std::span<const int> cpus)
+{
+#ifdef __linux__
+    if (cpus.empty())
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[index % cpus.size()], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)index;
+    (void)cpus;
+#endif
+}
+
 }  // namespace
 
 int main(int argc, char** argv)
 {
     // Check command line arguments.
-    if (argc != 5)
+    std::optional<server_config> cfg = parse_config(argc, argv);
+    if (!cfg)
     {
-        std::cerr << "Usage: " << argv[0] << " <db-username> <db-password> <db-hostname> <http-port>\n";
+        std::cerr << "Usage: " << argv[0]
+                  << " <db-username> <db-password> <db-hostname> <http-port> [--threads=<num-threads>] "
+                     "[--binary-port=<port>] [--idle-timeout=<seconds>] [--request-timeout=<seconds>]"
+                     " [--max-requests=<num-requests>] "
+                     "[--pipeline-depth=<num-requests>] [--max-batch-size=<num-ids>] "
+                     "[--batch-window-us=<microseconds>] [--cache-size-mb=<megabytes>] "
+                     "[--cache-ttl=<seconds>] [--cache-max-stale=<seconds>] [--max-lookup-ids=<num-ids>] "
+                     "[--readahead=<num-ids>] [--hot-keys=<count>] [--hot-key-window=<seconds>] "
+                     "[--id-filter-refresh=<seconds>] [--mirror-sync=<seconds>] [--mirror-file=<path>] "
+                     "[--mirror-save=<seconds>]\n";
         return EXIT_FAILURE;
     }
-    auto port = static_cast<unsigned short>(std::stoi(argv[4]));
 
-    // Execution context. This is a heavyweight object
+#ifndef SO_REUSEPORT
+    if (cfg->num_threads > 1)
+    {
+        std::cerr << "Running more than one thread requires SO_REUSEPORT, "
+                     "which is not supported by this system\n";
+        return EXIT_FAILURE;
+    }
+#endif
+
+    // Configuration for the MySQL pools. Each thread gets its own pool.
+    // The total number of connections is split evenly between threads,
+    // so we don't open more connections than a single-threaded server would.
+    mysql::pool_params pool_params{
+        .server_address = mysql::host_and_port(cfg->db_hostname),
+        .username = cfg->db_username,
+        .password = cfg->db_password,
+        .database = "correlations",
+    };
+    pool_params.max_size = std::max<std::size_t>(pool_params.max_size / cfg->num_threads, 1u);
+
+    // State shared by all workers, including the response cache
+    shared_state shared(*cfg);
+
+    // Create the workers. Each one contains an execution context. This is a heavyweight object
     // containing all the required infrastructure to run async operations,
     // including a scheduler, timer queues, file descriptors...
-    asio::io_context ctx;
+    std::vector<std::unique_ptr<worker>> workers;
+    workers.reserve(cfg->num_threads);
+    for (std::size_t i = 0; i < cfg->num_threads; ++i)
+        workers.push_back(std::make_unique<worker>(pool_params, *cfg, shared, i));
 
-    // Launch the MySQL pool
-    mysql::connection_pool pool(
-        ctx,
-        {
-            .server_address = mysql::host_and_port(argv[3]),
-            .username = argv[1],
-            .password = argv[2],
-            .database = "usingstdcpp",
-        }
-    );
-    pool.async_run(asio::detached);
+    // Launch the MySQL pools
+    for (auto& w : workers)
+        w->pool.async_run(asio::detached);
 
-    // Start listening for HTTP connections
-    asio::co_spawn(
-        ctx,
-        [&pool, port] { return listener(pool, port); },
-        [](std::exception_ptr exc) {
-            if (exc)
-                std::rethrow_exception(exc);
-        }
-    );
+    if (cfg->mirror_sync_interval.count() != 0)
+    {
+        // Mirror mode. Listeners are started once the table has been loaded
+        asio::co_spawn(
+            workers.front()->ctx,
+            [&workers, &config = *cfg] { return run_mirror(workers, config); },
+            [](std::exception_ptr exc) {
+                if (exc)
+                    std::rethrow_exception(exc);
+            }
+        );
+    }
+    else
+    {
+        // Start listening for HTTP connections
+        for (auto& w : workers)
+            start_listener(*w, *cfg);
+
+        // Refresh the cache and the ID filter in the background
+        start_database_tasks(workers, *cfg);
+    }
 
     // Capture SIGINT and SIGTERM to perform a clean shutdown
-    asio::signal_set signals(ctx, SIGINT, SIGTERM);
-    signals.async_wait([&ctx](error_code, int) {
-        // Stop the execution context. This will cause run() to exit
-        ctx.stop();
+    asio::signal_set signals(workers.front()->ctx, SIGINT, SIGTERM);
+    signals.async_wait([&workers](error_code, int) {
+        // Stop all the execution contexts. This will cause run() to exit
+        for (auto& w : workers)
+            w->ctx.stop();
     });
 
-    // Run until stopped
-    ctx.run();
+    // Runs a worker until stopped. If an exception is thrown,
+    // stop all the other workers, too, so the server exits.
+    // The CPUs are queried before any thread is pinned, since threads inherit their creator's mask
+    std::vector<int> cpus = usable_cpus();
+    auto run_worker = [&workers, &cpus](std::size_t index) {
+        if (workers.size() > 1)
+            pin_to_core(index, cpus);
+        try
+        {
+            workers[index]->ctx.run();
+        }
+        catch (...)
+        {
+            for (auto& w : workers)
+                w->ctx.stop();
+            throw;
+        }
+    };
+
+    // Run one worker per thread. The main thread runs the first one.
+    // std::jthread joins on destruction, so we wait for all threads to finish before exiting
+    std::vector<std::jthread> threads;
+    for (std::size_t i = 1; i < workers.size(); ++i)
+    {
+        threads.emplace_back([&run_worker, i] {
+            try
+            {
+                run_worker(i);
+            }
+            catch (...)
+            {
+                log_exception(std::current_exception());
+            }
+        });
+    }
+    run_worker(0);
 }
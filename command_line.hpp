@@ -0,0 +1,26 @@
+//
+// Copyright (c) 2019-2025 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef USINGSTDCPP_2025_COMMAND_LINE_HPP
+#define USINGSTDCPP_2025_COMMAND_LINE_HPP
+
+// Command-line parsing helpers, shared by the cancellations server and its benchmarks.
+
+#include <charconv>
+#include <string_view>
+#include <system_error>
+
+// Parses an unsigned integer from a command-line flag value.
+// Returns false if the value is not valid.
+template <class T>
+bool parse_flag_value(std::string_view value, T& to)
+{
+    auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), to);
+    return ec == std::errc{} && ptr == value.data() + value.size();
+}
+
+#endif
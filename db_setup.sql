@@ -16,7 +16,9 @@ USE correlations;
 -- Tables
 CREATE TABLE correlations(
     id INT NOT NULL PRIMARY KEY AUTO_INCREMENT,
-    subject VARCHAR(200) NOT NULL
+    subject VARCHAR(200) NOT NULL,
+    updated_at TIMESTAMP(6) NOT NULL DEFAULT CURRENT_TIMESTAMP(6) ON UPDATE CURRENT_TIMESTAMP(6),
+    INDEX (updated_at)
 );
 
 -- Sample values
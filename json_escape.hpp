@@ -0,0 +1,117 @@
+//
+// Copyright (c) 2019-2025 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef USINGSTDCPP_2025_JSON_ESCAPE_HPP
+#define USINGSTDCPP_2025_JSON_ESCAPE_HPP
+
+// Escaping of JSON strings, used by the cancellations server to serialize responses.
+// It lives in its own header so bench_json can compare it with Boost.JSON.
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Returns the position of the first character in value, starting at pos,
+// that must be escaped in a JSON string: quotes, backslashes and control characters.
+// Returns value.size() if there is none. Strings rarely contain such characters,
+// so they're searched in blocks of 32 (AVX2) or 16 (SSE2) characters
+inline std::size_t find_json_escape(std::string_view value, std::size_t pos)
+{
+    const char* data = value.data();
+    std::size_t size = value.size();
+
+#ifdef __AVX2__
+    const __m256i quote32 = _mm256_set1_epi8('"');
+    const __m256i backslash32 = _mm256_set1_epi8('\\');
+    const __m256i max_control32 = _mm256_set1_epi8(0x1f);
+    for (; pos + 32 <= size; pos += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+
+        // There are no unsigned comparisons: c <= 0x1f iff min(c, 0x1f) == c
+        __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, max_control32), chunk);
+        __m256i special = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote32), _mm256_cmpeq_epi8(chunk, backslash32)),
+            control
+        );
+        auto mask = static_cast<std::uint32_t>(_mm256_movemask_epi8(special));
+        if (mask != 0)
+            return pos + std::countr_zero(mask);
+    }
+#endif
+
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i max_control = _mm_set1_epi8(0x1f);
+    for (; pos + 16 <= size; pos += 16)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(chunk, max_control), chunk);
+        __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+            control
+        );
+        auto mask = static_cast<unsigned>(_mm_movemask_epi8(special));
+        if (mask != 0)
+            return pos + std::countr_zero(mask);
+    }
+#endif
+
+    // The remaining characters, or all of them without SIMD
+    for (; pos < size; ++pos)
+    {
+        auto c = static_cast<unsigned char>(data[pos]);
+        if (c == '"' || c == '\\' || c < 0x20)
+            return pos;
+    }
+    return size;
+}
+
+// Appends a string to out as a JSON string literal, escaping it as required.
+// Runs of characters that don't need escaping are copied in bulk, directly into out
+inline void append_json_string(std::string& out, std::string_view value)
+{
+    constexpr std::string_view hex_digits = "0123456789abcdef";
+
+    out.push_back('"');
+    std::size_t pos = 0;
+    while (true)
+    {
+        std::size_t next = find_json_escape(value, pos);
+        out.append(value.data() + pos, next - pos);
+        if (next == value.size())
+            break;
+
+        auto c = static_cast<unsigned char>(value[next]);
+        if (c == '"' || c == '\\')
+        {
+            out.push_back('\\');
+            out.push_back(static_cast<char>(c));
+        }
+        else
+        {
+            out.append("\\u00");
+            out.push_back(hex_digits[c >> 4]);
+            out.push_back(hex_digits[c & 0xf]);
+        }
+        pos = next + 1;
+    }
+    out.push_back('"');
+}
+
+#endif
@@ -0,0 +1,392 @@
+//
+// Copyright (c) 2019-2025 Ruben Perez Hidalgo (rubenperez038 at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef USINGSTDCPP_2025_TIMER_WHEEL_HPP
+#define USINGSTDCPP_2025_TIMER_WHEEL_HPP
+
+// Per-operation timeouts backed by a timer wheel, used by the cancellations server.
+// It lives in its own header so bench_timeouts can compare it with asio::cancel_after.
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/associated_cancellation_slot.hpp>
+#include <boost/asio/associator.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/cancellation_signal.hpp>
+#include <boost/asio/cancellation_type.hpp>
+#include <boost/asio/deferred.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+// A hierarchical timer wheel, for timeouts that are almost always disarmed before they expire.
+// Asio timers are kept in a heap: each one costs a heap insertion and removal.
+// The wheel divides time in ticks, and timeouts are rounded up to a whole number of them.
+// Timeouts are kept in linked lists (slots). There are several levels of 64 slots, where each slot
+// spans 64 times as many ticks as a slot in the level below. A timeout is linked into the slot
+// where it expires, at the finest level that reaches that far, so arming and disarming it is O(1).
+// As time passes, the slots in coarser levels are moved (cascaded) into finer ones.
+// A single Asio timer wakes the wheel up once per tick, and only while there are timeouts armed.
+// Timeout entries are recycled, so arming a timeout doesn't allocate.
+// Not thread-safe: each worker has its own.
+class timer_wheel
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    // An armed timeout. Entries are owned by the wheel
+    struct entry
+    {
+        // Links to the other entries in the slot (or in the free list)
+        entry* prev{};
+        entry* next{};
+
+        // The head of the slot containing this entry, if it's armed
+        entry** slot{};
+
+        // The tick where the timeout expires
+        std::uint64_t expiry{};
+
+        // Emitted when the timeout expires
+        boost::asio::cancellation_signal signal;
+        boost::asio::cancellation_type type{boost::asio::cancellation_type::terminal};
+    };
+
+private:
+    static constexpr unsigned slot_bits = 6;
+    static constexpr std::uint64_t slot_mask = (1u << slot_bits) - 1;
+    static constexpr std::size_t num_levels = 4;
+
+    // Timeouts further in the future expire after this many ticks
+    static constexpr std::uint64_t max_ticks = (std::uint64_t(1) << (slot_bits * num_levels)) - 1;
+
+    clock::duration tick_;
+    clock::time_point start_{clock::now()};
+
+    // The last tick that has been processed
+    std::uint64_t now_{};
+
+    std::array<std::array<entry*, slot_mask + 1>, num_levels> slots_{};
+    std::size_t num_armed_{};
+
+    // Entries are allocated in a deque, so their addresses are stable,
+    // and unused ones are kept in a free list
+    std::deque<entry> storage_;
+    entry* free_{};
+
+    std::optional<boost::asio::steady_timer> ticker_;
+    bool ticking_{};
+
+    std::uint64_t current_tick() const { return static_cast<std::uint64_t>((clock::now() - start_) / tick_); }
+
+    void link(entry* e)
+    {
+        // Find the finest level reaching the expiry
+        std::uint64_t delta = e->expiry - now_;
+        std::size_t level = 0;
+        while (level + 1 < num_levels && delta >= (std::uint64_t(1) << (slot_bits * (level + 1))))
+            ++level;
+
+        entry*& head = slots_[level][(e->expiry >> (slot_bits * level)) & slot_mask];
+        e->slot = &head;
+        e->prev = nullptr;
+        e->next = head;
+        if (head)
+            head->prev = e;
+        head = e;
+    }
+
+    void unlink(entry* e)
+    {
+        if (e->prev)
+            e->prev->next = e->next;
+        else
+            *e->slot = e->next;
+        if (e->next)
+            e->next->prev = e->prev;
+        e->slot = nullptr;
+    }
+
+    // Processes ticks up to the given one, firing the timeouts that expire
+    void advance(std::uint64_t to)
+    {
+        while (now_ < to)
+        {
+            ++now_;
+
+            // When the slots in a level wrap around, a slot in the next level
+            // has been reached. Its entries are moved to finer levels.
+            // Coarser levels go first, since they may move entries to the slots reached in finer ones
+            for (std::size_t level = num_levels - 1; level > 0; --level)
+            {
+                if ((now_ & ((std::uint64_t(1) << (slot_bits * level)) - 1)) != 0)
+                    continue;
+                entry* e = std::exchange(slots_[level][(now_ >> (slot_bits * level)) & slot_mask], nullptr);
+                while (e)
+                {
+                    entry* next = e->next;
+                    link(e);
+                    e = next;
+                }
+            }
+
+            // Fire the timeouts in the current slot. Cancellation handlers don't
+            // complete operations inline, so this doesn't re-enter the wheel
+            entry*& head = slots_[0][now_ & slot_mask];
+            while (head)
+            {
+                entry* e = head;
+                unlink(e);
+                --num_armed_;
+                e->signal.emit(e->type);
+            }
+        }
+    }
+
+    void schedule()
+    {
+        ticking_ = true;
+        ticker_->expires_at(start_ + tick_ * static_cast<clock::rep>(now_ + 1));
+        ticker_->async_wait([this](boost::system::error_code ec) {
+            ticking_ = false;
+            if (ec || !ticker_)
+                return;
+            advance(current_tick());
+            if (num_armed_ != 0)
+                schedule();
+        });
+    }
+
+public:
+    explicit timer_wheel(clock::duration tick) : tick_(tick) {}
+
+    // Starts running the wheel's timer in the given executor.
+    // Timeouts armed before this never expire
+    void start(boost::asio::any_io_executor ex) { ticker_.emplace(std::move(ex)); }
+
+    // Destroys the wheel's timer. Must be called before the executor's execution context is destroyed.
+    // Entries are still valid, so handlers can release them when the context destroys them
+    void stop() { ticker_.reset(); }
+
+    // Arms a timeout. The entry's signal is emitted once it expires
+    entry* arm(clock::duration timeout, boost::asio::cancellation_type type)
+    {
+        entry* e = free_;
+        if (e)
+            free_ = e->next;
+        else
+            e = &storage_.emplace_back();
+
+        // The wheel doesn't run while it's empty, so it may need to catch up.
+        // Nothing would be cascaded or fired
+        std::uint64_t current = current_tick();
+        if (num_armed_ == 0)
+            now_ = std::max(now_, current);
+
+        // Round the timeout up, so it doesn't expire early
+        timeout = std::max(timeout, clock::duration::zero());
+        auto ticks = static_cast<std::uint64_t>((timeout + tick_ - clock::duration(1)) / tick_);
+        e->expiry = std::clamp(current + ticks, now_ + 1, now_ + max_ticks);
+        e->type = type;
+        link(e);
+        ++num_armed_;
+
+        if (!ticking_ && ticker_)
+            schedule();
+        return e;
+    }
+
+    // Disarms a timeout if it hasn't expired, and recycles its entry
+    void release(entry* e)
+    {
+        if (e->slot)
+        {
+            unlink(e);
+            --num_armed_;
+        }
+        e->signal.slot().clear();
+        e->next = std::exchange(free_, e);
+    }
+};
+
+// A completion handler that cancels the operation if it doesn't complete before a timeout,
+// like the ones created by asio::cancel_after, but using a timer_wheel.
+// The operation gets the entry's cancellation slot. Cancellations requested by the parent
+// (e.g. the coroutine awaiting the operation) are forwarded to it.
+// The handler's executor, allocator and so on are the ones of the wrapped handler.
+template <class Handler>
+class wheel_timeout_handler
+{
+    // Forwards cancellations from the parent to the operation
+    struct forward_cancellation
+    {
+        timer_wheel::entry* entry;
+        void operator()(boost::asio::cancellation_type type) { entry->signal.emit(type); }
+    };
+
+    Handler handler_;
+    timer_wheel* wheel_;
+    timer_wheel::entry* entry_;
+    boost::asio::cancellation_slot parent_;
+
+    void release()
+    {
+        if (entry_)
+        {
+            if (parent_.is_connected())
+                parent_.clear();
+            wheel_->release(std::exchange(entry_, nullptr));
+        }
+    }
+
+public:
+    using cancellation_slot_type = boost::asio::cancellation_slot;
+
+    wheel_timeout_handler(
+        Handler handler,
+        timer_wheel& wheel,
+        timer_wheel::clock::duration timeout,
+        boost::asio::cancellation_type type
+    )
+        : handler_(std::move(handler)),
+          wheel_(&wheel),
+          entry_(wheel.arm(timeout, type)),
+          parent_(boost::asio::get_associated_cancellation_slot(handler_))
+    {
+        if (parent_.is_connected())
+            parent_.template emplace<forward_cancellation>(entry_);
+    }
+
+    wheel_timeout_handler(wheel_timeout_handler&& rhs) noexcept
+        : handler_(std::move(rhs.handler_)),
+          wheel_(rhs.wheel_),
+          entry_(std::exchange(rhs.entry_, nullptr)),
+          parent_(rhs.parent_)
+    {
+    }
+
+    wheel_timeout_handler& operator=(wheel_timeout_handler&&) = delete;
+
+    // Handlers may be destroyed without being invoked (e.g. when the execution context is destroyed)
+    ~wheel_timeout_handler() { release(); }
+
+    cancellation_slot_type get_cancellation_slot() const noexcept { return entry_->signal.slot(); }
+
+    const Handler& handler() const noexcept { return handler_; }
+
+    template <class... Args>
+    void operator()(Args&&... args)
+    {
+        // Disarm the timeout before invoking the handler, which may arm another one
+        release();
+        std::move(handler_)(std::forward<Args>(args)...);
+    }
+};
+
+// Launches an operation, wrapping its handler
+template <class Initiation>
+struct wheel_timeout_initiation
+{
+    timer_wheel* wheel;
+    timer_wheel::clock::duration timeout;
+    boost::asio::cancellation_type type;
+    Initiation initiation;
+
+    template <class Handler, class... Args>
+    void operator()(Handler&& handler, Args&&... args)
+    {
+        using handler_type = wheel_timeout_handler<std::decay_t<Handler>>;
+        std::move(initiation)(
+            handler_type(std::forward<Handler>(handler), *wheel, timeout, type),
+            std::forward<Args>(args)...
+        );
+    }
+};
+
+// A completion token that adds a timeout to an operation using a timer_wheel
+template <class CompletionToken>
+struct wheel_timeout_token
+{
+    timer_wheel* wheel;
+    timer_wheel::clock::duration timeout;
+    boost::asio::cancellation_type type;
+    CompletionToken token;
+};
+
+// Like asio::cancel_after, but using a timer wheel. Timeouts are rounded up to the wheel's tick.
+// Use it with the wheel of the thread running the operation
+template <class CompletionToken = boost::asio::deferred_t>
+wheel_timeout_token<std::decay_t<CompletionToken>> wheel_cancel_after(
+    timer_wheel& wheel,
+    timer_wheel::clock::duration timeout,
+    CompletionToken&& token = {},
+    boost::asio::cancellation_type type = boost::asio::cancellation_type::terminal
+)
+{
+    return {&wheel, timeout, type, std::forward<CompletionToken>(token)};
+}
+
+// Like asio::cancel_at, but using a timer wheel
+template <class CompletionToken = boost::asio::deferred_t>
+wheel_timeout_token<std::decay_t<CompletionToken>> wheel_cancel_at(
+    timer_wheel& wheel,
+    timer_wheel::clock::time_point deadline,
+    CompletionToken&& token = {},
+    boost::asio::cancellation_type type = boost::asio::cancellation_type::terminal
+)
+{
+    return {&wheel, deadline - timer_wheel::clock::now(), type, std::forward<CompletionToken>(token)};
+}
+
+// Makes wheel_cancel_after usable as a completion token
+template <class CompletionToken, class... Signatures>
+struct boost::asio::async_result<wheel_timeout_token<CompletionToken>, Signatures...>
+{
+    template <class Initiation, class RawCompletionToken, class... Args>
+    static auto initiate(Initiation&& initiation, RawCompletionToken&& token, Args&&... args)
+    {
+        return boost::asio::async_initiate<CompletionToken, Signatures...>(
+            wheel_timeout_initiation<std::decay_t<Initiation>>{
+                token.wheel,
+                token.timeout,
+                token.type,
+                std::forward<Initiation>(initiation),
+            },
+            token.token,
+            std::forward<Args>(args)...
+        );
+    }
+};
+
+// Propagates the associated executor, allocator and so on from the wrapped handler.
+// The cancellation slot is not affected, since wheel_timeout_handler defines its own
+template <template <class, class> class Associator, class Handler, class DefaultCandidate>
+struct boost::asio::associator<Associator, wheel_timeout_handler<Handler>, DefaultCandidate>
+    : Associator<Handler, DefaultCandidate>
+{
+    static typename Associator<Handler, DefaultCandidate>::type get(const wheel_timeout_handler<Handler>& h
+    ) noexcept
+    {
+        return Associator<Handler, DefaultCandidate>::get(h.handler());
+    }
+
+    static auto get(const wheel_timeout_handler<Handler>& h, const DefaultCandidate& c) noexcept
+        -> decltype(Associator<Handler, DefaultCandidate>::get(h.handler(), c))
+    {
+        return Associator<Handler, DefaultCandidate>::get(h.handler(), c);
+    }
+};
+
+#endif